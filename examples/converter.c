@@ -2,24 +2,131 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+
+/* Use POSIX features where available: memory-mapped input, directories */
+/* as batch inputs, and the CPU count as the default number of threads  */
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define POCKETMOD_IMPLEMENTATION
 #include "pocketmod.h"
 
 #define SAMPLE_RATE 44100
 
-/* Write a 16-bit little-endian integer to a file */
-static void fputw(unsigned short value, FILE *file)
+/* Frames rendered per pipeline block, and the number of blocks in flight */
+#define BLOCK_FRAMES 65536
+#define NUM_BLOCKS 2
+
+/* Size of the stdio buffer used for the output file */
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+/* Number of worker threads in batch mode when the CPU count is unknown */
+#define DEFAULT_WORKERS 1
+
+/* Output sample formats */
+enum { FORMAT_S16, FORMAT_S24, FORMAT_F32 };
+
+/* A MOD file loaded into memory, either mapped or copied to a heap block */
+typedef struct {
+    char *data;
+    int size;
+    int mapped;
+} mod_file;
+
+/* Load a MOD file, mapping it into memory if possible (returns 0 on error) */
+static int load_mod(mod_file *mod, const char *filename)
+{
+    FILE *file;
+    long size;
+
+#ifdef USE_POSIX
+    /* pocketmod reads patterns and samples in place, so a read-only mapping */
+    /* is all it needs. Pre-fault the pages so rendering doesn't stall. */
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1 && !fstat(fd, &info) && S_ISREG(info.st_mode)
+     && info.st_size > 0 && info.st_size <= 0x7fffffff) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        void *data = mmap(NULL, info.st_size, PROT_READ, flags, fd, 0);
+        if (data != MAP_FAILED) {
+#ifdef MADV_WILLNEED
+            madvise(data, info.st_size, MADV_WILLNEED);
+#endif
+            close(fd);
+            mod->data = data;
+            mod->size = (int) info.st_size;
+            mod->mapped = 1;
+            return 1;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+#endif
+
+    /* Fall back to reading the whole file into a heap block */
+    mod->mapped = 0;
+    if (!(file = fopen(filename, "rb"))) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    if (size <= 0 || !(mod->data = malloc(size))) {
+        fclose(file);
+        return 0;
+    } else if (!fread(mod->data, size, 1, file)) {
+        free(mod->data);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    mod->size = (int) size;
+    return 1;
+}
+
+/* Release a MOD file loaded with load_mod() */
+static void unload_mod(mod_file *mod)
+{
+#ifdef USE_POSIX
+    if (mod->mapped) {
+        munmap(mod->data, mod->size);
+        return;
+    }
+#endif
+    free(mod->data);
+}
+
+/* Store a 16-bit little-endian integer in a buffer */
+static unsigned char *put16(unsigned char *dst, unsigned long value)
+{
+    dst[0] = value & 0xff;
+    dst[1] = (value >> 8) & 0xff;
+    return dst + 2;
+}
+
+/* Store a 32-bit little-endian integer in a buffer */
+static unsigned char *put32(unsigned char *dst, unsigned long value)
 {
-    fputc(value & 0xff, file);
-    fputc(value >> 8, file);
+    dst = put16(dst, value & 0xffff);
+    return put16(dst, (value >> 16) & 0xffff);
 }
 
-/* Write a 32-bit little-endian integer to a file */
-static void fputl(unsigned long value, FILE *file)
+/* Store a four-character code in a buffer */
+static unsigned char *putcc(unsigned char *dst, const char *code)
 {
-    fputw(value & 0xffff, file);
-    fputw(value >> 16, file);
+    memcpy(dst, code, 4);
+    return dst + 4;
 }
 
 /* Clip a floating point sample to the [-1, +1] range */
@@ -30,11 +137,170 @@ static float clip(float value)
     return value;
 }
 
+/* Bytes per stereo frame for each output format */
+static int frame_bytes(int format)
+{
+    switch (format) {
+        case FORMAT_S24: return 6;
+        case FORMAT_F32: return 8;
+        default: return 4;
+    }
+}
+
+/* Size of the WAV header for each output format. Float data isn't PCM, */
+/* so its header has a longer fmt chunk and a fact chunk too. */
+#define MAX_HEADER_SIZE 58
+static int header_size(int format)
+{
+    return format == FORMAT_F32 ? 58 : 44;
+}
+
+/* Build a WAV header for 'frames' stereo frames */
+/* Follow along at home: http://soundfile.sapp.org/doc/WaveFormat/ */
+static void make_header(unsigned char *header, int format, unsigned long frames)
+{
+    int bytes = frame_bytes(format), pcm = format != FORMAT_F32;
+    unsigned long data_size = frames * bytes;
+    unsigned long chunk_size = data_size + header_size(format) - 8;
+    header = putcc(header, "RIFF");                /* ChunkID       */
+    header = put32(header, chunk_size);            /* ChunkSize     */
+    header = putcc(header, "WAVE");                /* Format        */
+    header = putcc(header, "fmt ");                /* Subchunk1ID   */
+    header = put32(header, pcm ? 16 : 18);         /* Subchunk1Size */
+    header = put16(header, pcm ? 1 : 3);           /* AudioFormat   */
+    header = put16(header, 2);                     /* NumChannels   */
+    header = put32(header, SAMPLE_RATE);           /* SampleRate    */
+    header = put32(header, SAMPLE_RATE * bytes);   /* ByteRate      */
+    header = put16(header, bytes);                 /* BlockAlign    */
+    header = put16(header, bytes * 4);             /* BitsPerSample */
+    if (!pcm) {
+        header = put16(header, 0);                 /* cbSize        */
+        header = putcc(header, "fact");            /* ChunkID       */
+        header = put32(header, 4);                 /* ChunkSize     */
+        header = put32(header, frames);            /* SampleLength  */
+    }
+    header = putcc(header, "data");                /* Subchunk2ID   */
+    header = put32(header, data_size);             /* Subchunk2Size */
+}
+
+/* Convert rendered float frames to the output format */
+static void convert(unsigned char *dst, float (*src)[2], int frames, int format)
+{
+    int i, j;
+    for (i = 0; i < frames; i++) {
+        for (j = 0; j < 2; j++) {
+            if (format == FORMAT_S16) {
+                long value = (long) (clip(src[i][j]) * 0x7fff);
+                dst = put16(dst, (unsigned long) value);
+            } else if (format == FORMAT_S24) {
+                long value = (long) (clip(src[i][j]) * 0x7fffff);
+                dst = put16(dst, (unsigned long) value);
+                *dst++ = ((unsigned long) value >> 16) & 0xff;
+            } else {
+                unsigned long bits = 0;
+                memcpy(&bits, &src[i][j], 4);
+                dst = put32(dst, bits);
+            }
+        }
+    }
+}
+
+/* Peak level to normalize songs to (just below full scale) */
+#define NORMALIZE_PEAK 0.99f
+
+/* Gain that brings a song with the given peak level to NORMALIZE_PEAK */
+static float normalize_gain(float peak)
+{
+    return peak > 0.0f ? NORMALIZE_PEAK / peak : 1.0f;
+}
+
+/* Highest peak in either channel measured by the last render call */
+static float meter_peak(pocketmod_meter *meter, float peak)
+{
+    peak = meter->peak[0] > peak ? meter->peak[0] : peak;
+    return meter->peak[1] > peak ? meter->peak[1] : peak;
+}
+
+/* Read float frames back from a temporary file, scale them by 'gain' and */
+/* write them to 'file' in the output format (returns 0 on error) */
+static int write_scaled(FILE *file, FILE *temp, float (*frames)[2],
+                        unsigned char *output, int format, float gain)
+{
+    size_t i, count;
+    rewind(temp);
+    while ((count = fread(frames, sizeof(float[2]), BLOCK_FRAMES, temp))) {
+        for (i = 0; i < count; i++) {
+            frames[i][0] *= gain;
+            frames[i][1] *= gain;
+        }
+        convert(output, frames, count, format);
+        fwrite(output, count * frame_bytes(format), 1, file);
+    }
+    return !ferror(temp);
+}
+
+/* A block of rendered frames passed from the render thread to the writer */
+typedef struct {
+    float frames[BLOCK_FRAMES][2];
+    int count;                  /* Number of valid frames in the block */
+    int full;                   /* Block is waiting to be written      */
+    int last;                   /* No more blocks will follow this one */
+} block;
+
+/* State shared between the render thread and the writer */
+typedef struct {
+    pocketmod_context *context;
+    pocketmod_meter meter;      /* Levels of the last render call      */
+    float peak;                 /* Highest peak level so far           */
+    block *blocks;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} pipeline;
+
+/* Render thread: fill blocks until the song loops */
+static void *render_thread(void *userdata)
+{
+    pipeline *p = userdata;
+    int i, last = 0;
+    for (i = 0; !last; i = (i + 1) % NUM_BLOCKS) {
+        block *b = &p->blocks[i];
+
+        /* Wait for the writer to hand this block back */
+        pthread_mutex_lock(&p->lock);
+        while (b->full) {
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        /* Render as much as fits, stopping early if the song loops */
+        b->count = 0;
+        while (b->count < BLOCK_FRAMES) {
+            int size = (BLOCK_FRAMES - b->count) * sizeof(float[2]);
+            int bytes = pocketmod_render(p->context, b->frames[b->count], size);
+            b->count += bytes / sizeof(float[2]);
+            p->peak = meter_peak(&p->meter, p->peak);
+            if (pocketmod_loop_count(p->context) > 0) {
+                last = 1;
+                break;
+            }
+        }
+
+        /* Pass the block on to the writer */
+        pthread_mutex_lock(&p->lock);
+        b->last = last;
+        b->full = 1;
+        pthread_cond_broadcast(&p->changed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
 /* Print file size and duration statistics */
-static void show_stats(char *filename, int samples)
+static void show_stats(char *filename, unsigned long frames, int format)
 {
-    int seconds = (double) samples / SAMPLE_RATE;
-    int filesize = samples * 4 + 44;
+    int seconds = (double) frames / SAMPLE_RATE;
+    double filesize = (double) frames * frame_bytes(format)
+                    + header_size(format);
     printf("\rWriting: '%s' ", filename);
     printf("[%.1f MB] ", filesize / 1000000.0);
     printf("[%d:%02d] ", seconds / 60, seconds % 60);
@@ -42,106 +308,561 @@ static void show_stats(char *filename, int samples)
     fflush(stdout);
 }
 
+/* Batch mode: a list of input files shared by a pool of worker threads */
+typedef struct {
+    char **files;               /* Input file paths                      */
+    char **outfiles;            /* Output file path for each input file  */
+    int num_files;              /* Number of input files                 */
+    int next_file;              /* Index of the next file to hand out    */
+    const char *outdir;         /* Directory to write WAV files to       */
+    int format;                 /* Output sample format                  */
+    int quality;                /* Resampling quality                    */
+    int normalize;              /* Scale each song to a fixed peak level */
+    int converted, failed;      /* Number of files converted/failed      */
+    double audio_seconds;       /* Total duration of the converted songs */
+    pthread_mutex_t lock;
+} batch;
+
+/* Buffers owned by one batch worker, reused for every song it converts */
+typedef struct {
+    pocketmod_context context;
+    pocketmod_meter meter;
+    float frames[BLOCK_FRAMES][2];
+    unsigned char output[BLOCK_FRAMES * 8];
+    char io_buffer[WRITE_BUFFER_SIZE];
+} worker;
+
+/* Build "<outdir>/<name>.wav" from an input path (caller frees the result) */
+static char *output_path(const char *outdir, const char *infile)
+{
+    const char *name = infile, *slash, *dot;
+    char *path;
+    int length;
+    while ((slash = strpbrk(name, "/\\"))) {
+        name = slash + 1;
+    }
+    dot = strrchr(name, '.');
+    length = dot && dot != name ? (int) (dot - name) : (int) strlen(name);
+    if ((path = malloc(strlen(outdir) + length + 6))) {
+        sprintf(path, "%s/%.*s.wav", outdir, length, name);
+    }
+    return path;
+}
+
+/* An output path, and the index of the input file written to it */
+typedef struct {
+    const char *path;
+    int index;
+} output_name;
+
+/* Order output names by path, then by input file */
+static int compare_outputs(const void *a, const void *b)
+{
+    const output_name *x = a, *y = b;
+    int order = strcmp(x->path, y->path);
+    return order ? order : x->index - y->index;
+}
+
+/* Work out the output path of every input file up front, and fail if two */
+/* of them would be written to the same file (returns 0 on error) */
+static int plan_outputs(batch *b)
+{
+    output_name *names;
+    int i, ok = 1;
+    if (!(b->outfiles = calloc(b->num_files, sizeof(char*)))
+     || !(names = malloc(b->num_files * sizeof(output_name)))) {
+        printf("error: out of memory\n");
+        return 0;
+    }
+    for (i = 0; i < b->num_files; i++) {
+        if (!(b->outfiles[i] = output_path(b->outdir, b->files[i]))) {
+            printf("error: out of memory\n");
+            free(names);
+            return 0;
+        }
+        names[i].path = b->outfiles[i];
+        names[i].index = i;
+    }
+    qsort(names, b->num_files, sizeof(output_name), compare_outputs);
+    for (i = 1; i < b->num_files; i++) {
+        if (!strcmp(names[i - 1].path, names[i].path)) {
+            printf("error: '%s' and '%s' would both be written to '%s'\n",
+                   b->files[names[i - 1].index], b->files[names[i].index],
+                   names[i].path);
+            ok = 0;
+        }
+    }
+    free(names);
+    return ok;
+}
+
+/* Convert one song in batch mode (returns an error message, or NULL) */
+static const char *convert_song(worker *w, batch *b, int index,
+                                unsigned long *frames)
+{
+    const char *infile = b->files[index];
+    unsigned char header[MAX_HEADER_SIZE];
+    mod_file mod;
+    FILE *file, *temp = NULL;
+    float peak = 0.0f;
+    int looped = 0;
+
+    /* Load the song and prepare the worker's context for rendering it */
+    *frames = 0;
+    if (!load_mod(&mod, infile)) {
+        return "can't read file";
+    } else if (!pocketmod_init(&w->context, mod.data, mod.size, SAMPLE_RATE)) {
+        unload_mod(&mod);
+        return "not a valid MOD file";
+    } else if (!pocketmod_set_quality(&w->context, b->quality)) {
+        unload_mod(&mod);
+        return "invalid quality";
+    } else if (!(file = fopen(b->outfiles[index], "wb"))) {
+        unload_mod(&mod);
+        return "can't open output file for writing";
+    }
+    setvbuf(file, w->io_buffer, _IOFBF, WRITE_BUFFER_SIZE);
+
+    /* When normalizing, keep the rendered frames in a temporary file until */
+    /* the song's peak level is known */
+    if (b->normalize && !(temp = tmpfile())) {
+        unload_mod(&mod);
+        fclose(file);
+        return "can't create temporary file";
+    }
+    pocketmod_set_meter(&w->context, &w->meter);
+
+    /* Render, convert and write the song one block at a time */
+    make_header(header, b->format, 0);
+    fwrite(header, header_size(b->format), 1, file);
+    while (!looped) {
+        int count = 0;
+        while (count < BLOCK_FRAMES && !looped) {
+            int size = (BLOCK_FRAMES - count) * sizeof(float[2]);
+            int bytes = pocketmod_render(&w->context, w->frames[count], size);
+            count += bytes / sizeof(float[2]);
+            looped = pocketmod_loop_count(&w->context) > 0;
+            peak = meter_peak(&w->meter, peak);
+        }
+        if (temp) {
+            fwrite(w->frames, sizeof(float[2]), count, temp);
+        } else {
+            convert(w->output, w->frames, count, b->format);
+            fwrite(w->output, count * frame_bytes(b->format), 1, file);
+        }
+        *frames += count;
+    }
+
+    /* Scale the whole song by the same amount on the way to the output */
+    if (temp) {
+        int ok = write_scaled(file, temp, w->frames, w->output, b->format,
+                              normalize_gain(peak));
+        fclose(temp);
+        if (!ok) {
+            unload_mod(&mod);
+            fclose(file);
+            return "error reading temporary file";
+        }
+    }
+
+    /* Fill in the final sizes */
+    make_header(header, b->format, *frames);
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, header_size(b->format), 1, file);
+    unload_mod(&mod);
+    return fclose(file) ? "error writing output file" : NULL;
+}
+
+/* Batch worker thread: keep taking songs from the shared list until it's */
+/* empty. Each song is a sizable job, so a shared index balances the load */
+/* across workers just as well as per-thread queues would. */
+static void *batch_thread(void *userdata)
+{
+    batch *b = userdata;
+    worker *w = malloc(sizeof(worker));
+    for (;;) {
+        const char *error = "out of memory";
+        unsigned long frames = 0;
+        int index;
+
+        /* Grab the next file */
+        pthread_mutex_lock(&b->lock);
+        index = b->next_file++;
+        pthread_mutex_unlock(&b->lock);
+        if (index >= b->num_files) {
+            break;
+        }
+
+        /* Convert it and record the result */
+        if (w) {
+            error = convert_song(w, b, index, &frames);
+        }
+        pthread_mutex_lock(&b->lock);
+        if (error) {
+            printf("error: '%s': %s\n", b->files[index], error);
+            b->failed++;
+        } else {
+            b->converted++;
+            b->audio_seconds += (double) frames / SAMPLE_RATE;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    free(w);
+    return NULL;
+}
+
+/* Add a file to the batch, growing the list as needed */
+static int add_file(batch *b, const char *path)
+{
+    char **files, *copy;
+    if ((b->num_files & (b->num_files - 1)) == 0) {
+        int capacity = b->num_files ? b->num_files * 2 : 16;
+        if (!(files = realloc(b->files, capacity * sizeof(char*)))) {
+            return 0;
+        }
+        b->files = files;
+    }
+    if (!(copy = malloc(strlen(path) + 1))) {
+        return 0;
+    }
+    b->files[b->num_files++] = strcpy(copy, path);
+    return 1;
+}
+
+#ifdef USE_POSIX
+/* Add every file in a directory whose name ends with ".mod" */
+static int add_directory(batch *b, const char *path)
+{
+    struct dirent *entry;
+    DIR *dir;
+    if (!(dir = opendir(path))) {
+        return 0;
+    }
+    while ((entry = readdir(dir))) {
+        const char *dot = strrchr(entry->d_name, '.');
+        char *file;
+        if (!dot || strlen(dot) != 4 || (dot[1] | 0x20) != 'm'
+         || (dot[2] | 0x20) != 'o' || (dot[3] | 0x20) != 'd') {
+            continue;
+        }
+        if (!(file = malloc(strlen(path) + strlen(entry->d_name) + 2))) {
+            closedir(dir);
+            return 0;
+        }
+        sprintf(file, "%s/%s", path, entry->d_name);
+        if (!add_file(b, file)) {
+            free(file);
+            closedir(dir);
+            return 0;
+        }
+        free(file);
+    }
+    closedir(dir);
+    return 1;
+}
+#endif
+
+/* Add a command-line input: a directory, a file, or "-" for a list of */
+/* file names on standard input */
+static int add_input(batch *b, const char *path)
+{
+#ifdef USE_POSIX
+    struct stat info;
+#endif
+    if (!strcmp(path, "-")) {
+        char line[4096];
+        while (fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] && !add_file(b, line)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+#ifdef USE_POSIX
+    if (!stat(path, &info) && S_ISDIR(info.st_mode)) {
+        return add_directory(b, path);
+    }
+#endif
+    return add_file(b, path);
+}
+
+/* Seconds elapsed on a monotonic clock */
+static double wall_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Convert a list of files and directories using 'num_workers' threads */
+static int batch_main(char **inputs, int num_inputs, const char *outdir,
+                      int format, int quality, int normalize,
+                      int num_workers)
+{
+    pthread_t *threads;
+    double start, elapsed;
+    batch b;
+    int i;
+
+    /* Collect the input files */
+    memset(&b, 0, sizeof(b));
+    b.outdir = outdir;
+    b.format = format;
+    b.quality = quality;
+    b.normalize = normalize;
+    for (i = 0; i < num_inputs; i++) {
+        if (!add_input(&b, inputs[i])) {
+            printf("error: can't read input '%s'\n", inputs[i]);
+            return -1;
+        }
+    }
+    if (b.num_files == 0) {
+        printf("error: no input files\n");
+        return -1;
+    } else if (!plan_outputs(&b)) {
+        return -1;
+    }
+
+    /* Start the workers and wait for them to run out of songs */
+    num_workers = num_workers < b.num_files ? num_workers : b.num_files;
+    if (!(threads = malloc(num_workers * sizeof(pthread_t)))) {
+        printf("error: can't allocate worker threads\n");
+        return -1;
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    start = wall_time();
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, batch_thread, &b)) {
+            printf("error: can't create worker thread\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = wall_time() - start;
+    elapsed = elapsed > 0.0 ? elapsed : 1e-9;
+
+    /* Print a throughput summary */
+    printf("Converted %d of %d songs ", b.converted, b.num_files);
+    printf("(%d failed) in %.2f s using %d threads\n", b.failed, elapsed,
+           num_workers);
+    printf("Throughput: %.2f songs/s, %.4f audio-hours per wall-second\n",
+           b.converted / elapsed, b.audio_seconds / 3600.0 / elapsed);
+
+    /* Tidy up before leaving */
+    pthread_mutex_destroy(&b.lock);
+    for (i = 0; i < b.num_files; i++) {
+        free(b.files[i]);
+        free(b.outfiles[i]);
+    }
+    free(b.files);
+    free(b.outfiles);
+    free(threads);
+    return b.failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     pocketmod_context context;
-    char *mod_data, *slash;
-    int i, mod_size, samples = 0;
-    clock_t time_now, time_prev = 0;
-    FILE *file;
+    pipeline p;
+    pthread_t thread;
+    mod_file mod;
+    unsigned char header[MAX_HEADER_SIZE], *output;
+    char *slash, *infile, *outfile, *outdir = NULL;
+    unsigned long frames = 0;
+    int i, last, format = FORMAT_S16, workers = DEFAULT_WORKERS;
+    int quality = POCKETMOD_QUALITY_DEFAULT, normalize = 0;
+    FILE *file, *temp = NULL;
+
+#if defined(USE_POSIX) && defined(_SC_NPROCESSORS_ONLN)
+    workers = sysconf(_SC_NPROCESSORS_ONLN) > 0
+            ? (int) sysconf(_SC_NPROCESSORS_ONLN) : workers;
+#endif
+
+    /* Parse options */
+    while (argc > 2 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        if (!strcmp(argv[1], "-n")) {
+            normalize = 1;
+            argv[1] = argv[0];
+            argc -= 1;
+            argv += 1;
+            continue;
+        } else if (!strcmp(argv[1], "-f")) {
+            if (!strcmp(argv[2], "s16")) {
+                format = FORMAT_S16;
+            } else if (!strcmp(argv[2], "s24")) {
+                format = FORMAT_S24;
+            } else if (!strcmp(argv[2], "f32")) {
+                format = FORMAT_F32;
+            } else {
+                printf("error: unknown sample format '%s'\n", argv[2]);
+                return -1;
+            }
+        } else if (!strcmp(argv[1], "-q")) {
+            if (!strcmp(argv[2], "linear")) {
+                quality = POCKETMOD_QUALITY_DEFAULT;
+            } else if (!strcmp(argv[2], "cubic")) {
+                quality = POCKETMOD_QUALITY_CUBIC;
+            } else if (!strcmp(argv[2], "sinc8")) {
+                quality = POCKETMOD_QUALITY_SINC8;
+            } else if (!strcmp(argv[2], "sinc16")) {
+                quality = POCKETMOD_QUALITY_SINC16;
+            } else {
+                printf("error: unknown quality '%s'\n", argv[2]);
+                return -1;
+            }
+        } else if (!strcmp(argv[1], "-b")) {
+            outdir = argv[2];
+        } else if (!strcmp(argv[1], "-j")) {
+            if ((workers = atoi(argv[2])) <= 0) {
+                printf("error: invalid thread count '%s'\n", argv[2]);
+                return -1;
+            }
+        } else {
+            break;
+        }
+        argv[2] = argv[0]; /* Keep the program name in argv[0] */
+        argc -= 2;
+        argv += 2;
+    }
+
+    /* The resampling tables are shared between threads, so make sure */
+    /* they're ready before any are started */
+    pocketmod_set_quality(NULL, quality);
+
+    /* Convert a whole list of files in batch mode */
+    if (outdir && argc >= 2) {
+        return batch_main(argv + 1, argc - 1, outdir, format, quality,
+                          normalize, workers);
+    }
 
     /* Print usage if no file was given */
-    if (argc != 3) {
-        printf("usage: %s <infile> <outfile>\n", argv[0]);
+    if (outdir || argc != 3) {
+        printf("usage: %s [-n] [-f s16|s24|f32] [-q quality] "
+               "<infile> <outfile>\n", argv[0]);
+        printf("       %s [-n] [-f s16|s24|f32] [-q quality] [-j threads] "
+               "-b <outdir> <infile|dir|->...\n", argv[0]);
+        printf("quality: linear (default), cubic, sinc8 or sinc16\n");
+        printf("-n: normalize the peak level of each song\n");
         return -1;
     }
+    infile = argv[1];
+    outfile = argv[2];
 
-    /* Read the input file into a heap block */
-    if (!(file = fopen(argv[1], "rb"))) {
-        printf("error: can't open '%s' for reading\n", argv[1]);
+    /* Map or read the input file into memory */
+    if (!load_mod(&mod, infile)) {
+        printf("error: can't read file '%s'\n", infile);
         return -1;
     }
-    fseek(file, 0, SEEK_END);
-    mod_size = ftell(file);
-    rewind(file);
-    if (!(mod_data = malloc(mod_size))) {
-        printf("error: %d-byte memory allocation failed\n", mod_size);
+
+    /* Initialize the renderer */
+    if (!pocketmod_init(&context, mod.data, mod.size, SAMPLE_RATE)) {
+        printf("error: '%s' is not a valid MOD file\n", infile);
         return -1;
-    } else if (!fread(mod_data, mod_size, 1, file)) {
-        printf("error: error reading file '%s'\n", argv[1]);
+    }
+    pocketmod_set_quality(&context, quality);
+
+    /* Allocate the pipeline blocks and the conversion buffer */
+    p.blocks = calloc(NUM_BLOCKS, sizeof(block));
+    output = malloc(BLOCK_FRAMES * frame_bytes(FORMAT_F32));
+    if (!p.blocks || !output) {
+        printf("error: can't allocate conversion buffers\n");
         return -1;
     }
-    fclose(file);
 
-    /* Initialize the renderer */
-    if (!pocketmod_init(&context, mod_data, mod_size, SAMPLE_RATE)) {
-        printf("error: '%s' is not a valid MOD file\n", argv[1]);
+    /* Open the output file with a large buffer, so that stdio issues a few */
+    /* big writes instead of many small ones */
+    if (!(file = fopen(outfile, "wb"))) {
+        printf("error: can't open '%s' for writing\n", outfile);
         return -1;
     }
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
 
-    /* Open the output file */
-    if (!(file = fopen(argv[2], "wb"))) {
-        printf("error: can't open '%s' for writing\n", argv[2]);
+    /* When normalizing, keep the rendered frames in a temporary file until */
+    /* the song's peak level is known */
+    if (normalize && !(temp = tmpfile())) {
+        printf("error: can't create temporary file\n");
         return -1;
     }
 
     /* Strip the directory part from the output file's path */
-    while ((slash = strpbrk(argv[2], "/\\"))) {
-        argv[2] = slash + 1;
-    }
-
-    /* Write the WAV header */
-    /* Follow along at home: http://soundfile.sapp.org/doc/WaveFormat/ */
-    fputs("RIFF", file);          /* ChunkID       */
-    fputl(0, file);               /* ChunkSize     */
-    fputs("WAVE", file);          /* Format        */
-    fputs("fmt ", file);          /* Subchunk1ID   */
-    fputl(16, file);              /* Subchunk1Size */
-    fputw(1, file);               /* AudioFormat   */
-    fputw(2, file);               /* NumChannels   */
-    fputl(SAMPLE_RATE, file);     /* SampleRate    */
-    fputl(SAMPLE_RATE * 4, file); /* ByteRate      */
-    fputw(4, file);               /* BlockAlign    */
-    fputw(16, file);              /* BitsPerSample */
-    fputs("data", file);          /* Subchunk2ID   */
-    fputl(0, file);               /* Subchunk2Size */
-
-    /* Write sample data */
-    float buffer[512][2];
-    short output[512][2];
-    while (pocketmod_loop_count(&context) == 0) {
-
-        /* Render a chunk of samples */
-        int rendered_bytes = pocketmod_render(&context, buffer, sizeof(buffer));
-        int rendered_samples = rendered_bytes / sizeof(float[2]);
-        samples += rendered_samples;
-
-        /* Convert the sample data to 16-bit and write it to the file */
-        for (i = 0; i < rendered_samples; i++) {
-            output[i][0] = (short) (clip(buffer[i][0]) * 0x7fff);
-            output[i][1] = (short) (clip(buffer[i][1]) * 0x7fff);
-        }
-        fwrite(output, rendered_samples * sizeof(short[2]), 1, file);
-
-        /* Print statistics at regular intervals */
-        time_now = clock();
-        if ((double) (time_now - time_prev) / CLOCKS_PER_SEC > 0.1) {
-            show_stats(argv[2], samples);
-            time_prev = time_now;
-        }
-    }
-    show_stats(argv[2], samples);
+    while ((slash = strpbrk(outfile, "/\\"))) {
+        outfile = slash + 1;
+    }
+
+    /* Write a placeholder WAV header. The song length isn't known until it */
+    /* has been rendered, so the sizes are filled in at the end. */
+    make_header(header, format, 0);
+    fwrite(header, header_size(format), 1, file);
+
+    /* Start rendering on a separate thread, metering as it goes */
+    p.context = &context;
+    p.peak = 0.0f;
+    pocketmod_set_meter(&context, &p.meter);
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.changed, NULL);
+    if (pthread_create(&thread, NULL, render_thread, &p)) {
+        printf("error: can't create render thread\n");
+        return -1;
+    }
+
+    /* Convert and write blocks as they become available */
+    for (i = 0, last = 0; !last; i = (i + 1) % NUM_BLOCKS) {
+        block *b = &p.blocks[i];
+
+        /* Wait for the render thread to fill this block */
+        pthread_mutex_lock(&p.lock);
+        while (!b->full) {
+            pthread_cond_wait(&p.changed, &p.lock);
+        }
+        pthread_mutex_unlock(&p.lock);
+
+        /* Convert the sample data and write it to the file */
+        if (temp) {
+            fwrite(b->frames, sizeof(float[2]), b->count, temp);
+        } else {
+            convert(output, b->frames, b->count, format);
+            fwrite(output, b->count * frame_bytes(format), 1, file);
+        }
+        frames += b->count;
+        last = b->last;
+
+        /* Hand the block back to the render thread */
+        pthread_mutex_lock(&p.lock);
+        b->full = 0;
+        pthread_cond_broadcast(&p.changed);
+        pthread_mutex_unlock(&p.lock);
+        show_stats(outfile, frames, format);
+    }
+    pthread_join(thread, NULL);
     putchar('\n');
 
-    /* Now that we know how many samples we got, we can go back and patch the */
-    /* ChunkSize and Subchunk2Size fields in the WAV header */
-    fseek(file, 4, SEEK_SET);
-    fputl(samples * 4 + 36, file);
-    fseek(file, 40, SEEK_SET);
-    fputl(samples * 4, file);
+    /* Scale the whole song by the same amount on the way to the output */
+    if (temp) {
+        float gain = normalize_gain(p.peak);
+        printf("Normalizing: peak level %.3f, gain %.3f\n", p.peak, gain);
+        if (!write_scaled(file, temp, p.blocks[0].frames, output, format,
+                          gain)) {
+            printf("error: can't read temporary file\n");
+            return -1;
+        }
+        fclose(temp);
+    }
+
+    /* Now that we know how many frames we got, go back and rewrite the */
+    /* header with the final sizes (and frame count, for float data) */
+    make_header(header, format, frames);
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, header_size(format), 1, file);
 
     /* Tidy up before leaving */
-    free(mod_data);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+    unload_mod(&mod);
+    free(p.blocks);
+    free(output);
     fclose(file);
     return 0;
 }
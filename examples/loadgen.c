@@ -0,0 +1,325 @@
+/* Load generator for the streaming server example. It opens a number of */
+/* listener connections, reads the audio as fast as it arrives, and every */
+/* second reports how far the listeners lag behind real time, along with  */
+/* the server's CPU use per listener when given the server's process ID.  */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_SECONDS 10
+#define MAX_EVENTS 256
+#define MAX_HEADER 128
+
+/* A listener connection */
+typedef struct {
+    int fd;
+    char header[MAX_HEADER];    /* Stream description from the server   */
+    int header_length;
+    int bytes_per_second;       /* Zero until the header has been read  */
+    double start;               /* Time the connection was opened       */
+    unsigned long long bytes;   /* Audio bytes received                 */
+    double lag;                 /* Wall time minus audio time received  */
+    double worst_lag;           /* Highest lag seen so far              */
+    int closed;
+} listener;
+
+/* Seconds elapsed on a monotonic clock */
+static double wall_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* CPU time used by another process, in seconds (negative on error) */
+static double process_cpu_time(long pid)
+{
+    char path[64], line[1024], *fields;
+    unsigned long utime, stime;
+    FILE *file;
+    int ok;
+    sprintf(path, "/proc/%ld/stat", pid);
+    if (!(file = fopen(path, "r"))) {
+        return -1.0;
+    }
+    ok = fgets(line, sizeof(line), file) != NULL;
+    fclose(file);
+
+    /* Skip past the command name, which may contain spaces */
+    if (!ok || !(fields = strrchr(line, ')'))) {
+        return -1.0;
+    } else if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+                      " %lu %lu", &utime, &stime) != 2) {
+        return -1.0;
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Connect to "host:port" or a Unix domain socket path (returns -1 on error) */
+static int connect_to(const char *address)
+{
+    const char *colon = strrchr(address, ':');
+    int fd = -1;
+    if (colon && !strchr(address, '/')) {
+        struct addrinfo hints, *info, *ai;
+        char host[256];
+        int length = (int) (colon - address);
+        if (length >= (int) sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, address, length);
+        host[length] = '\0';
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &info)) {
+            return -1;
+        }
+        for (ai = info; ai && fd == -1; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(info);
+    } else {
+        struct sockaddr_un addr;
+        if (strlen(address) >= sizeof(addr.sun_path)
+         || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* Parse the stream header, "pocketmod s16le <rate> <channels> <name>" */
+static int parse_header(listener *l)
+{
+    int rate, channels;
+    if (sscanf(l->header, "pocketmod s16le %d %d", &rate, &channels) != 2
+     || rate <= 0 || channels <= 0) {
+        return 0;
+    }
+    l->bytes_per_second = rate * channels * 2;
+    l->worst_lag = -1e9;
+    return 1;
+}
+
+/* Read whatever has arrived on a connection (returns 0 when it's closed) */
+static int receive(listener *l)
+{
+    static char buffer[65536];
+    ssize_t got = read(l->fd, buffer, sizeof(buffer));
+    char *data = buffer;
+    if (got < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    } else if (got == 0) {
+        return 0;
+    }
+
+    /* Take the header line off the front of the stream */
+    while (!l->bytes_per_second && got > 0) {
+        char c = *data++;
+        got--;
+        if (c == '\n') {
+            l->header[l->header_length] = '\0';
+            if (!parse_header(l)) {
+                printf("error: unexpected stream header '%s'\n", l->header);
+                return 0;
+            }
+        } else if (l->header_length < MAX_HEADER - 1) {
+            l->header[l->header_length++] = c;
+        }
+    }
+    l->bytes += got;
+    return 1;
+}
+
+/* Update a listener's lag: wall time since connecting, minus the length */
+/* of the audio received. A negative lag is audio buffered ahead. */
+static void update_lag(listener *l, double now)
+{
+    if (l->bytes_per_second && !l->closed) {
+        l->lag = (now - l->start) - (double) l->bytes / l->bytes_per_second;
+        l->worst_lag = l->lag > l->worst_lag ? l->lag : l->worst_lag;
+    }
+}
+
+/* Print lag and server CPU use for the last second */
+static void show_status(listener *listeners, int count, double now,
+                        double cpu_usage)
+{
+    double total = 0.0, worst = -1e9;
+    int i, active = 0;
+    for (i = 0; i < count; i++) {
+        listener *l = &listeners[i];
+        update_lag(l, now);
+        if (l->bytes_per_second && !l->closed) {
+            total += l->lag;
+            worst = l->lag > worst ? l->lag : worst;
+            active++;
+        }
+    }
+    printf("%4d listeners", active);
+    if (active > 0) {
+        printf(", lag avg %+7.1f ms, max %+7.1f ms", 1000.0 * total / active,
+               1000.0 * worst);
+    }
+    if (cpu_usage >= 0.0) {
+        printf(", server CPU %.2f%%", 100.0 * cpu_usage);
+        if (active > 0) {
+            printf(" (%.4f%% per listener)", 100.0 * cpu_usage / active);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    static struct epoll_event events[MAX_EVENTS];
+    listener *listeners;
+    const char *station = "0";
+    int i, epoll_fd, count = DEFAULT_CLIENTS, seconds = DEFAULT_SECONDS;
+    int verbose = 0, dropped = 0;
+    long pid = 0;
+    double start, next_status, last_cpu = -1.0;
+    char request[32];
+
+    /* Parse options */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-v")) {
+            verbose = 1;
+            argv[1] = argv[0];
+            argc -= 1;
+            argv += 1;
+            continue;
+        } else if (!strcmp(argv[1], "-n")) {
+            if ((count = atoi(argv[2])) <= 0) {
+                printf("error: invalid listener count '%s'\n", argv[2]);
+                return -1;
+            }
+        } else if (!strcmp(argv[1], "-t")) {
+            if ((seconds = atoi(argv[2])) <= 0) {
+                printf("error: invalid duration '%s'\n", argv[2]);
+                return -1;
+            }
+        } else if (!strcmp(argv[1], "-s")) {
+            station = argv[2];
+        } else if (!strcmp(argv[1], "-P")) {
+            pid = atol(argv[2]);
+        } else {
+            break;
+        }
+        argv[2] = argv[0]; /* Keep the program name in argv[0] */
+        argc -= 2;
+        argv += 2;
+    }
+
+    /* Print usage if no address was given */
+    if (argc != 2) {
+        printf("usage: %s [-n listeners] [-t seconds] [-s station] "
+               "[-P server pid] [-v] <host:port|socket>\n", argv[0]);
+        return -1;
+    }
+
+    /* Open all the connections and ask for the station */
+    if (!(listeners = calloc(count, sizeof(listener)))
+     || (epoll_fd = epoll_create1(0)) == -1) {
+        printf("error: can't set up %d listeners\n", count);
+        return -1;
+    }
+    if (strlen(station) > sizeof(request) - 2) {
+        printf("error: invalid station '%s'\n", station);
+        return -1;
+    }
+    sprintf(request, "%s\n", station);
+    for (i = 0; i < count; i++) {
+        listener *l = &listeners[i];
+        struct epoll_event event;
+        if ((l->fd = connect_to(argv[1])) == -1) {
+            printf("error: can't connect to '%s' (%d connected)\n", argv[1],
+                   i);
+            return -1;
+        } else if (write(l->fd, request, strlen(request)) < 0) {
+            printf("error: can't send request\n");
+            return -1;
+        }
+        fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+        l->start = wall_time();
+        event.events = EPOLLIN;
+        event.data.ptr = l;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, l->fd, &event);
+    }
+    printf("Connected %d listeners to '%s'\n", count, argv[1]);
+
+    /* Read until time is up, printing a status line every second */
+    start = wall_time();
+    next_status = start + 1.0;
+    if (pid) {
+        last_cpu = process_cpu_time(pid);
+    }
+    while (wall_time() < start + seconds) {
+        double now, timeout = next_status - wall_time();
+        int num = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                             timeout > 0.0 ? (int) (timeout * 1000) + 1 : 0);
+        for (i = 0; i < num; i++) {
+            listener *l = events[i].data.ptr;
+            if (!receive(l)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, l->fd, NULL);
+                l->closed = 1;
+                dropped++;
+            }
+        }
+        if ((now = wall_time()) >= next_status) {
+            double cpu = pid ? process_cpu_time(pid) : -1.0;
+            double usage = cpu >= 0.0 && last_cpu >= 0.0
+                         ? (cpu - last_cpu) / (now - next_status + 1.0) : -1.0;
+            show_status(listeners, count, now, usage);
+            last_cpu = cpu;
+            next_status = now + 1.0;
+        }
+    }
+
+    /* Summarize each listener's lag */
+    if (verbose) {
+        for (i = 0; i < count; i++) {
+            listener *l = &listeners[i];
+            printf("listener %4d: %8.1f s received, lag %+7.1f ms, "
+                   "worst %+7.1f ms%s\n", i,
+                   l->bytes_per_second ? (double) l->bytes
+                                       / l->bytes_per_second : 0.0,
+                   1000.0 * l->lag, 1000.0 * l->worst_lag,
+                   l->closed ? " (closed)" : "");
+        }
+    }
+    for (i = 0; i < count; i++) {
+        close(listeners[i].fd);
+    }
+    if (dropped) {
+        printf("%d of %d connections were closed by the server\n", dropped,
+               count);
+    }
+    close(epoll_fd);
+    free(listeners);
+    return dropped ? -1 : 0;
+}
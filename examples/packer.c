@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define POCKETMOD_IMPLEMENTATION
+#include "pocketmod.h"
+
+/* Sample rate used to measure song durations (low, since it's only timing) */
+#define ANALYSIS_RATE 8000
+
+/* Alignment of MOD payloads in the archive */
+#define PAGE_SIZE 4096
+
+/* Archive layout (see README.md) */
+#define HEADER_SIZE 16
+#define ENTRY_SIZE 64
+#define NAME_SIZE 44
+
+/* A list of input file paths */
+typedef struct {
+    char **paths;
+    int count;
+} file_list;
+
+/* Store a 32-bit little-endian integer in a buffer */
+static void put32(unsigned char *dst, unsigned long value)
+{
+    dst[0] = value & 0xff;
+    dst[1] = (value >> 8) & 0xff;
+    dst[2] = (value >> 16) & 0xff;
+    dst[3] = (value >> 24) & 0xff;
+}
+
+/* Add a path to a file list, growing the list as needed */
+static int add_file(file_list *list, const char *path)
+{
+    char **paths, *copy;
+    if ((list->count & (list->count - 1)) == 0) {
+        int capacity = list->count ? list->count * 2 : 16;
+        if (!(paths = realloc(list->paths, capacity * sizeof(char*)))) {
+            return 0;
+        }
+        list->paths = paths;
+    }
+    if (!(copy = malloc(strlen(path) + 1))) {
+        return 0;
+    }
+    list->paths[list->count++] = strcpy(copy, path);
+    return 1;
+}
+
+/* Add a file, or every ".mod" file in a directory */
+static int add_input(file_list *list, const char *path)
+{
+    struct dirent *entry;
+    struct stat info;
+    DIR *dir;
+    if (stat(path, &info) || !S_ISDIR(info.st_mode)) {
+        return add_file(list, path);
+    } else if (!(dir = opendir(path))) {
+        return 0;
+    }
+    while ((entry = readdir(dir))) {
+        const char *dot = strrchr(entry->d_name, '.');
+        char *file;
+        int ok;
+        if (!dot || strlen(dot) != 4 || (dot[1] | 0x20) != 'm'
+         || (dot[2] | 0x20) != 'o' || (dot[3] | 0x20) != 'd') {
+            continue;
+        }
+        if (!(file = malloc(strlen(path) + strlen(entry->d_name) + 2))) {
+            closedir(dir);
+            return 0;
+        }
+        sprintf(file, "%s/%s", path, entry->d_name);
+        ok = add_file(list, file);
+        free(file);
+        if (!ok) {
+            closedir(dir);
+            return 0;
+        }
+    }
+    closedir(dir);
+    return 1;
+}
+
+/* Read a whole file into a heap block (returns NULL on error) */
+static char *read_file(const char *filename, long *size)
+{
+    FILE *file;
+    char *data;
+    if (!(file = fopen(filename, "rb"))) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    if (*size <= 0 || !(data = malloc(*size))) {
+        fclose(file);
+        return NULL;
+    } else if (!fread(data, *size, 1, file)) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+/* Fill in an index entry for a MOD file (returns 0 if it's not valid) */
+static int make_entry(unsigned char *entry, const char *path, char *data,
+                      long size, unsigned long offset)
+{
+    static pocketmod_context context;
+    static float buffer[4096][2];
+    const char *name = path, *slash, *dot;
+    unsigned long frames = 0;
+    pocketmod_info info;
+    int length;
+
+    /* Render the song once at a low rate to find out how long it is */
+    if (!pocketmod_probe(data, size, &info)
+     || !pocketmod_init(&context, data, size, ANALYSIS_RATE)) {
+        return 0;
+    }
+    while (pocketmod_loop_count(&context) == 0) {
+        frames += pocketmod_render(&context, buffer, sizeof(buffer))
+                / sizeof(float[2]);
+    }
+
+    /* Use the file name without directory and extension as the song name */
+    while ((slash = strpbrk(name, "/\\"))) {
+        name = slash + 1;
+    }
+    dot = strrchr(name, '.');
+    length = dot && dot != name ? (int) (dot - name) : (int) strlen(name);
+    length = length < NAME_SIZE - 1 ? length : NAME_SIZE - 1;
+
+    /* Fill in the entry */
+    memset(entry, 0, ENTRY_SIZE);
+    memcpy(entry, name, length);
+    put32(entry + NAME_SIZE, offset);
+    put32(entry + NAME_SIZE + 4, size);
+    put32(entry + NAME_SIZE + 8, frames * 1000 / ANALYSIS_RATE);
+    memcpy(entry + NAME_SIZE + 12, info.tag, 4);
+    entry[NAME_SIZE + 16] = info.channels;
+    return 1;
+}
+
+/* Pack a list of MOD files into an archive */
+static int pack(const char *filename, file_list *list)
+{
+    static const unsigned char padding[PAGE_SIZE];
+    unsigned char *index;
+    unsigned long offset;
+    int i, count = 0;
+    FILE *file;
+
+    /* Reserve room for the header and a full index up front */
+    if (!(index = calloc(HEADER_SIZE + ENTRY_SIZE * list->count, 1))) {
+        printf("error: can't allocate archive index\n");
+        return -1;
+    } else if (!(file = fopen(filename, "wb"))) {
+        printf("error: can't open '%s' for writing\n", filename);
+        return -1;
+    }
+    offset = HEADER_SIZE + ENTRY_SIZE * list->count;
+
+    /* Write each MOD file at the next page boundary */
+    for (i = 0; i < list->count; i++) {
+        unsigned char *entry = index + HEADER_SIZE + ENTRY_SIZE * count;
+        unsigned long aligned = (offset + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1ul);
+        long size;
+        char *data;
+        if (!(data = read_file(list->paths[i], &size))) {
+            printf("error: can't read file '%s'\n", list->paths[i]);
+            continue;
+        } else if (!make_entry(entry, list->paths[i], data, size, aligned)) {
+            printf("error: '%s' is not a valid MOD file\n", list->paths[i]);
+            free(data);
+            continue;
+        }
+        fseek(file, offset, SEEK_SET);
+        fwrite(padding, aligned - offset, 1, file);
+        fwrite(data, size, 1, file);
+        offset = aligned + size;
+        free(data);
+        count++;
+    }
+
+    /* Go back and write the header and index */
+    memcpy(index, "PMAR", 4);
+    put32(index + 4, 1);
+    put32(index + 8, count);
+    put32(index + 12, PAGE_SIZE);
+    fseek(file, 0, SEEK_SET);
+    fwrite(index, HEADER_SIZE + ENTRY_SIZE * count, 1, file);
+    printf("Packed %d of %d songs into '%s'\n", count, list->count, filename);
+    free(index);
+    return fclose(file) ? -1 : 0;
+}
+
+/* Print the contents of an archive */
+static int list(const char *filename)
+{
+    pocketmod_archive_entry entry;
+    long size;
+    char *data;
+    int i, count;
+    if (!(data = read_file(filename, &size))) {
+        printf("error: can't read file '%s'\n", filename);
+        return -1;
+    } else if (!(count = pocketmod_archive_count(data, size))) {
+        printf("error: '%s' is not a valid archive\n", filename);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (pocketmod_archive_get(data, size, i, &entry)) {
+            int seconds = entry.duration / 1000;
+            printf("%-24s %4.4s %2dch %3d:%02d %8d bytes\n", entry.name,
+                   entry.tag[0] ? entry.tag : "----", entry.channels,
+                   seconds / 60, seconds % 60, entry.size);
+        }
+    }
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    file_list files = { NULL, 0 };
+    int i, result;
+
+    /* List an existing archive */
+    if (argc == 3 && !strcmp(argv[1], "-l")) {
+        return list(argv[2]);
+    }
+
+    /* Print usage if no file was given */
+    if (argc < 3) {
+        printf("usage: %s <archive> <infile|dir>...\n", argv[0]);
+        printf("       %s -l <archive>\n", argv[0]);
+        return -1;
+    }
+
+    /* Collect the input files and pack them */
+    for (i = 2; i < argc; i++) {
+        if (!add_input(&files, argv[i])) {
+            printf("error: can't read input '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+    result = pack(argv[1], &files);
+
+    /* Tidy up before leaving */
+    for (i = 0; i < files.count; i++) {
+        free(files.paths[i]);
+    }
+    free(files.paths);
+    return result;
+}
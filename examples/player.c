@@ -1,34 +1,257 @@
 #include <SDL2/SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+/* Use memory-mapped input where available */
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define POCKETMOD_IMPLEMENTATION
 #include "pocketmod.h"
 
-static void audio_callback(void *userdata, Uint8 *buffer, int bytes)
+/* A MOD file loaded into memory, either mapped or copied to a heap block */
+typedef struct {
+    char *data;
+    size_t size;
+    int mapped;
+} mod_file;
+
+/* Load a MOD file, mapping it into memory if possible (returns 0 on error) */
+static int load_mod(mod_file *mod, const char *filename)
+{
+    SDL_RWops *file;
+    Sint64 size;
+
+#ifdef USE_MMAP
+    /* pocketmod reads patterns and samples in place, so a read-only mapping */
+    /* is all it needs. Pre-fault the pages so the audio thread never does. */
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1 && !fstat(fd, &info) && S_ISREG(info.st_mode)
+     && info.st_size > 0 && info.st_size <= 0x7fffffff) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        void *data = mmap(NULL, info.st_size, PROT_READ, flags, fd, 0);
+        if (data != MAP_FAILED) {
+#ifdef MADV_WILLNEED
+            madvise(data, info.st_size, MADV_WILLNEED);
+#endif
+            close(fd);
+            mod->data = data;
+            mod->size = info.st_size;
+            mod->mapped = 1;
+            return 1;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+#endif
+
+    /* Fall back to reading the whole file into a heap block */
+    mod->mapped = 0;
+    if (!(file = SDL_RWFromFile(filename, "rb"))) {
+        return 0;
+    } else if ((size = SDL_RWsize(file)) <= 0 || size > 0x7fffffff) {
+        SDL_RWclose(file);
+        return 0;
+    } else if (!(mod->data = SDL_malloc(size))) {
+        SDL_RWclose(file);
+        return 0;
+    } else if (!SDL_RWread(file, mod->data, size, 1)) {
+        SDL_free(mod->data);
+        SDL_RWclose(file);
+        return 0;
+    }
+    SDL_RWclose(file);
+    mod->size = size;
+    return 1;
+}
+
+/* Release a MOD file loaded with load_mod() */
+static void unload_mod(mod_file *mod)
+{
+#ifdef USE_MMAP
+    if (mod->mapped) {
+        munmap(mod->data, mod->size);
+        return;
+    }
+#endif
+    SDL_free(mod->data);
+}
+
+/* A song in memory, with a context to render it */
+typedef struct {
+    mod_file mod;
+    pocketmod_context context;
+    int index;                  /* Position in the playlist               */
+} song_slot;
+
+/* State shared by the main thread, the loader thread and the callback. */
+/* The callback plays one slot, while the loader fills in the other. */
+typedef struct {
+    char **files;               /* Playlist file paths                    */
+    int count;                  /* Number of files in the playlist        */
+    int rate;                   /* Output sample rate                     */
+    song_slot slots[2];         /* The song playing and the one after it  */
+    int current;                /* Slot being played (0 or 1)             */
+    int fade_frames;            /* Crossfade length (0 for none)          */
+    int fade_left;              /* Frames left of the crossfade           */
+    SDL_atomic_t ready;         /* Set when the other slot can be played  */
+    SDL_atomic_t playing;       /* Playlist index of the song playing     */
+    SDL_sem *wake;              /* Posted when the other slot is free     */
+} playlist;
+
+/* Load and initialize a song into a slot (returns 0 on error) */
+static int load_song(song_slot *slot, const char *filename, int rate)
+{
+    if (!load_mod(&slot->mod, filename)) {
+        slot->mod.data = NULL;
+        return 0;
+    } else if (!pocketmod_init(&slot->context, slot->mod.data,
+                               slot->mod.size, rate)) {
+        unload_mod(&slot->mod);
+        slot->mod.data = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Strip the directory part from a file path */
+static const char *base_name(const char *path)
+{
+    const char *slash;
+    while ((slash = strpbrk(path, "/\\"))) {
+        path = slash + 1;
+    }
+    return path;
+}
+
+/* Background thread that loads the next song in the playlist whenever the */
+/* audio callback is done with the other slot, so that file I/O and */
+/* pocketmod_init() never happen on the audio path */
+static int loader_thread(void *userdata)
+{
+    playlist *list = userdata;
+    while (!SDL_SemWait(list->wake)) {
+        song_slot *slot;
+        int i, index;
+
+        /* Free whatever was in the slot before, and load the next song, */
+        /* skipping over any that can't be played */
+        slot = &list->slots[list->current ^ 1];
+        index = list->slots[list->current].index;
+        if (slot->mod.data) {
+            unload_mod(&slot->mod);
+            slot->mod.data = NULL;
+        }
+        for (i = 1; i < list->count; i++) {
+            slot->index = (index + i) % list->count;
+            if (load_song(slot, list->files[slot->index], list->rate)) {
+                SDL_AtomicSet(&list->ready, 1);
+                break;
+            }
+            printf("\nerror: can't play '%s'\n", list->files[slot->index]);
+        }
+    }
+    return 0;
+}
+
+/* Render frames from a song, and keep going until 'frames' are done */
+static void render_song(song_slot *slot, float (*output)[2], int frames)
 {
     int i = 0;
-    while (i < bytes) {
-        i += pocketmod_render(userdata, buffer + i, bytes - i);
+    while (i < frames) {
+        i += pocketmod_render(&slot->context, output + i,
+                              (frames - i) * sizeof(float[2]))
+           / sizeof(float[2]);
+    }
+}
+
+static void audio_callback(void *userdata, Uint8 *buffer, int bytes)
+{
+    static float fading[1024][2];
+    playlist *list = userdata;
+    float (*output)[2] = (float(*)[2]) buffer;
+    int i, frames = bytes / sizeof(float[2]);
+    while (frames > 0) {
+        song_slot *song = &list->slots[list->current];
+        int num = frames;
+
+        /* Move on once the song has played through, as long as the next */
+        /* one is ready. Otherwise, keep looping the current one. */
+        if (!list->fade_left && pocketmod_loop_count(&song->context) > 0
+         && SDL_AtomicGet(&list->ready)) {
+            SDL_AtomicSet(&list->ready, 0);
+            list->current ^= 1;
+            list->fade_left = list->fade_frames;
+            SDL_AtomicSet(&list->playing, list->slots[list->current].index);
+            if (!list->fade_left) {
+                SDL_SemPost(list->wake);
+            }
+            continue;
+        }
+
+        /* pocketmod_render() stops at the start of each pattern, so the */
+        /* check above is made right where the song loops. During a */
+        /* crossfade, don't go past its end. */
+        if (list->fade_left) {
+            num = num < list->fade_left ? num : list->fade_left;
+            num = num < 1024 ? num : 1024;
+        }
+        num = pocketmod_render(&song->context, output, num * sizeof(float[2]))
+            / sizeof(float[2]);
+
+        /* Crossfade from the previous song, which carries on from its loop */
+        /* point while fading out */
+        if (list->fade_left) {
+            render_song(&list->slots[list->current ^ 1], fading, num);
+            for (i = 0; i < num; i++) {
+                float gain = (list->fade_left - i) / (float) list->fade_frames;
+                output[i][0] += gain * (fading[i][0] - output[i][0]);
+                output[i][1] += gain * (fading[i][1] - output[i][1]);
+            }
+            list->fade_left -= num;
+            if (!list->fade_left) {
+                SDL_SemPost(list->wake);
+            }
+        }
+        output += num;
+        frames -= num;
     }
 }
 
 int main(int argc, char **argv)
 {
     const Uint32 allowed_changes = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE;
+    static playlist list;
     Uint32 start_time;
-    pocketmod_context context;
     SDL_AudioSpec format;
     SDL_AudioDeviceID device;
-    SDL_RWops *mod_file;
-    char *mod_data, *slash;
-    size_t mod_size;
+    SDL_Thread *loader;
+    int fade_ms = 0, arg = 1, playing = -1;
+
+    /* Parse the crossfade option */
+    if (argc > 2 && !strcmp(argv[1], "-x")) {
+        fade_ms = atoi(argv[2]);
+        arg = 3;
+    }
 
     /* Print usage if no file was given */
-    if (argc != 2) {
-        printf("usage: %s <modfile>\n", argv[0]);
+    if (arg >= argc || fade_ms < 0) {
+        printf("usage: %s [-x <crossfade ms>] <modfile>...\n", argv[0]);
         return -1;
     }
+    list.files = argv + arg;
+    list.count = argc - arg;
 
     /* Initialize SDL */
     if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
@@ -42,49 +265,48 @@ int main(int argc, char **argv)
     format.channels = 2;
     format.samples = 4096;
     format.callback = audio_callback;
-    format.userdata = &context;
+    format.userdata = &list;
     device = SDL_OpenAudioDevice(NULL, 0, &format, &format, allowed_changes);
     if (!device) {
         printf("error: SDL_OpenAudioDevice() failed: %s\n", SDL_GetError());
         return -1;
     }
+    list.rate = format.freq;
+    list.fade_frames = (int) ((long) format.freq * fade_ms / 1000);
 
-    /* Read the MOD file into a heap block */
-    if (!(mod_file = SDL_RWFromFile(argv[1], "rb"))) {
-        printf("error: can't open '%s' for reading\n", argv[1]);
-        return -1;
-    } else if (!(mod_data = SDL_malloc(mod_size = SDL_RWsize(mod_file)))) {
-        printf("error: can't allocate memory for '%s'\n", argv[1]);
-        return -1;
-    } else if (!SDL_RWread(mod_file, mod_data, mod_size, 1)) {
-        printf("error: can't read file '%s'\n", argv[1]);
+    /* Load the first song up front */
+    if (!load_song(&list.slots[0], list.files[0], list.rate)) {
+        printf("error: can't play '%s'\n", list.files[0]);
         return -1;
     }
-    SDL_RWclose(mod_file);
 
-    /* Initialize the renderer */
-    if (!pocketmod_init(&context, mod_data, mod_size, format.freq)) {
-        printf("error: '%s' is not a valid MOD file\n", argv[1]);
+    /* Start preloading the second song in the background */
+    if (!(list.wake = SDL_CreateSemaphore(list.count > 1))
+     || !(loader = SDL_CreateThread(loader_thread, "loader", &list))) {
+        printf("error: can't start loader thread: %s\n", SDL_GetError());
         return -1;
     }
 
-    /* Strip the directory part from the source file's path */
-    while ((slash = strpbrk(argv[1], "/\\"))) {
-        argv[1] = slash + 1;
-    }
-
     /* Start playback */
     SDL_PauseAudioDevice(device, 0);
     start_time = SDL_GetTicks();
     for (;;) {
 
         /* Print some information during playback */
-        int seconds = (SDL_GetTicks() - start_time) / 1000;
-        printf("\rPlaying '%s' ", argv[1]);
+        int seconds;
+        if (SDL_AtomicGet(&list.playing) != playing) {
+            printf("%s", playing >= 0 ? "\n" : "");
+            playing = SDL_AtomicGet(&list.playing);
+            start_time = SDL_GetTicks();
+        }
+        seconds = (SDL_GetTicks() - start_time) / 1000;
+        printf("\rPlaying '%s' ", base_name(list.files[playing]));
         printf("[%d:%02d] ", seconds / 60, seconds % 60);
         printf("Press Ctrl + C to stop");
         fflush(stdout);
         SDL_Delay(500);
     }
+
+    unload_mod(&list.slots[list.current].mod);
     return 0;
 }
@@ -0,0 +1,725 @@
+/* A radio-style streaming server for Linux. Each song is a station that is */
+/* rendered once, on its own thread, into a ring of 16-bit PCM blocks. One */
+/* epoll loop sends those same blocks to every listener of the station     */
+/* with sendmsg(), straight from the ring, so adding a listener costs a    */
+/* socket and a few bytes of bookkeeping rather than another render.       */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define POCKETMOD_IMPLEMENTATION
+#include "pocketmod.h"
+
+#define SAMPLE_RATE 44100
+
+/* Stations render in blocks of 2048 frames (about 46 ms) into a ring that */
+/* holds the last few seconds of audio */
+#define BLOCK_FRAMES 2048
+#define BLOCK_BYTES (BLOCK_FRAMES * 4)
+#define RING_BLOCKS 128
+
+/* Blocks a station may render ahead of real time */
+#define LEAD_BLOCKS 4
+
+/* Blocks sent at once to a new listener, so its playback can start */
+/* without waiting for the next block to be rendered */
+#define PREROLL_BLOCKS 8
+
+/* Listeners that fall further behind than this skip ahead, and lose some */
+/* audio. The gap to RING_BLOCKS keeps them clear of the block that the   */
+/* render thread is overwriting, since rendering never bursts far ahead.  */
+#define MAX_LAG_BLOCKS (RING_BLOCKS - 4 * LEAD_BLOCKS)
+
+/* Seconds between status lines */
+#define STATUS_INTERVAL 5.0
+
+#define DEFAULT_PORT 8000
+#define MAX_EVENTS 256
+#define MAX_REQUEST 16
+
+/* What an epoll event refers to */
+enum { ENDPOINT_LISTENER, ENDPOINT_WAKEUP, ENDPOINT_CLIENT };
+
+typedef struct {
+    int kind;
+    int fd;
+} endpoint;
+
+/* A song being streamed, and the ring of blocks rendered from it */
+typedef struct station {
+    const char *name;           /* Song name sent to listeners          */
+    char *data;                 /* MOD file contents                    */
+    pocketmod_context *context; /* Sized with pocketmod_context_size()  */
+    unsigned char *ring;        /* RING_BLOCKS blocks of s16le frames   */
+    struct client *clients;     /* Listeners (owned by the epoll loop)  */
+    unsigned long sent;         /* Blocks the epoll loop has handed out */
+    pthread_t thread;
+
+    /* Shared with the render thread (guarded by 'lock') */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned long head;         /* Number of blocks rendered            */
+    int listeners;              /* Render only while this is nonzero    */
+    int quit;
+} station;
+
+/* A connected listener */
+typedef struct client {
+    endpoint ep;
+    station *station;           /* NULL until the request line arrives  */
+    struct client *prev, *next; /* Other listeners of the same station  */
+    char request[MAX_REQUEST];  /* Station number, ending with '\n'     */
+    int request_length;
+    char header[128];           /* Stream description sent up front     */
+    int header_length;
+    int header_sent;
+    unsigned long seq;          /* Next block to send                   */
+    int offset;                 /* Bytes of block 'seq' already sent    */
+    int blocked;                /* Socket buffer full, wait for EPOLLOUT */
+    int dropped;                /* Closed, to be freed after this batch */
+    struct client *next_dropped;
+} client;
+
+static station *stations;
+static int num_stations;
+static int wakeup_fd;
+
+/* Clients dropped while handling a batch of events. Later events in the */
+/* same batch may still point to them, so they are freed afterwards. */
+static client *dropped_clients;
+static volatile sig_atomic_t stopping;
+
+/* Counters for the status line (epoll loop only) */
+static int num_listeners;
+static unsigned long overruns;
+static unsigned long long bytes_sent;
+
+/* Seconds elapsed on a monotonic clock */
+static double wall_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* CPU time used by the whole process, in seconds */
+static double cpu_time(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+         + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* Read a whole file into a heap block (returns NULL on error) */
+static char *read_file(const char *filename, long *size)
+{
+    FILE *file;
+    char *data;
+    if (!(file = fopen(filename, "rb"))) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    if (*size <= 0 || !(data = malloc(*size))) {
+        fclose(file);
+        return NULL;
+    } else if (!fread(data, *size, 1, file)) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+/* Convert rendered float frames to 16-bit little-endian PCM */
+static void convert(unsigned char *dst, float (*src)[2], int frames)
+{
+    int i, j;
+    for (i = 0; i < frames; i++) {
+        for (j = 0; j < 2; j++) {
+            float value = src[i][j];
+            long sample;
+            value = value < -1.0f ? -1.0f : value;
+            value = value > +1.0f ? +1.0f : value;
+            sample = (long) (value * 0x7fff);
+            *dst++ = (unsigned long) sample & 0xff;
+            *dst++ = ((unsigned long) sample >> 8) & 0xff;
+        }
+    }
+}
+
+/* Render thread: fill the ring one block at a time, paced to real time, */
+/* for as long as the station has listeners */
+static void *render_thread(void *userdata)
+{
+    static const unsigned long long one = 1;
+    const double block_seconds = (double) BLOCK_FRAMES / SAMPLE_RATE;
+    station *s = userdata;
+    float frames[BLOCK_FRAMES][2];
+    unsigned long seq, base = 0;
+    double start = -1.0;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        double ahead;
+        int bytes = 0;
+
+        /* Sleep while nobody is listening, and restart the clock after */
+        while (!s->quit && s->listeners == 0) {
+            pthread_cond_wait(&s->wake, &s->lock);
+            start = -1.0;
+        }
+        if (s->quit) {
+            break;
+        }
+        seq = s->head;
+        pthread_mutex_unlock(&s->lock);
+
+        /* Stay at most LEAD_BLOCKS ahead of the clock. When behind, don't */
+        /* try to catch up, so the ring never fills faster than that.      */
+        if (start < 0.0) {
+            start = wall_time();
+            base = seq;
+        }
+        ahead = (seq - base) * block_seconds - (wall_time() - start);
+        if (ahead < 0.0) {
+            start = wall_time();
+            base = seq;
+        } else if (ahead > LEAD_BLOCKS * block_seconds) {
+            double delay = ahead - LEAD_BLOCKS * block_seconds;
+            struct timespec nap;
+            nap.tv_sec = (time_t) delay;
+            nap.tv_nsec = (long) ((delay - nap.tv_sec) * 1e9);
+            nanosleep(&nap, NULL);
+        }
+
+        /* Render the next block. It goes in the slot of the oldest block, */
+        /* which no listener is allowed to be reading (see MAX_LAG_BLOCKS). */
+        while (bytes < (int) sizeof(frames)) {
+            bytes += pocketmod_render(s->context, (char*) frames + bytes,
+                                      sizeof(frames) - bytes);
+        }
+        convert(s->ring + seq % RING_BLOCKS * BLOCK_BYTES, frames,
+                BLOCK_FRAMES);
+
+        /* Publish it and wake up the epoll loop */
+        pthread_mutex_lock(&s->lock);
+        s->head = seq + 1;
+        if (write(wakeup_fd, &one, sizeof(one)) < 0) {
+            /* The counter can't overflow in practice, and a missed */
+            /* wakeup is made up for by the next block */
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* Change a station's listener count, waking up its render thread */
+static void add_listeners(station *s, int count)
+{
+    pthread_mutex_lock(&s->lock);
+    s->listeners += count;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    num_listeners += count;
+}
+
+/* Number of blocks a station has rendered so far */
+static unsigned long station_head(station *s)
+{
+    unsigned long head;
+    pthread_mutex_lock(&s->lock);
+    head = s->head;
+    pthread_mutex_unlock(&s->lock);
+    return head;
+}
+
+/* Close a connection and take it off its station's list. The client */
+/* itself is freed later by free_dropped_clients(). */
+static void drop_client(client *c)
+{
+    station *s = c->station;
+    if (c->dropped) {
+        return;
+    }
+    if (s) {
+        if (c->prev) {
+            c->prev->next = c->next;
+        } else {
+            s->clients = c->next;
+        }
+        if (c->next) {
+            c->next->prev = c->prev;
+        }
+        add_listeners(s, -1);
+    }
+    close(c->ep.fd);
+    c->dropped = 1;
+    c->next_dropped = dropped_clients;
+    dropped_clients = c;
+}
+
+/* Free the clients dropped since the last call */
+static void free_dropped_clients(void)
+{
+    while (dropped_clients) {
+        client *c = dropped_clients;
+        dropped_clients = c->next_dropped;
+        free(c);
+    }
+}
+
+/* Send a client everything it hasn't had yet, up to block 'head', straight */
+/* from the ring. Returns 0 if the connection should be dropped. */
+static int flush_client(client *c, unsigned long head)
+{
+    station *s = c->station;
+    while (!c->blocked) {
+        struct iovec iov[3];
+        struct msghdr msg;
+        unsigned long slot, count, wrapped;
+        ssize_t sent;
+        int n = 0;
+
+        /* Skip ahead if the client has fallen too far behind */
+        if (head - c->seq > MAX_LAG_BLOCKS) {
+            c->seq = head - PREROLL_BLOCKS;
+            c->offset = 0;
+            overruns++;
+        }
+
+        /* Gather the header (if not sent yet) and the blocks, which take */
+        /* up to two spans of the ring */
+        if (c->header_sent < c->header_length) {
+            iov[n].iov_base = c->header + c->header_sent;
+            iov[n++].iov_len = c->header_length - c->header_sent;
+        }
+        if ((count = head - c->seq) > 0) {
+            slot = c->seq % RING_BLOCKS;
+            wrapped = count > RING_BLOCKS - slot
+                    ? count - (RING_BLOCKS - slot) : 0;
+            iov[n].iov_base = s->ring + slot * BLOCK_BYTES + c->offset;
+            iov[n++].iov_len = (count - wrapped) * BLOCK_BYTES - c->offset;
+            if (wrapped) {
+                iov[n].iov_base = s->ring;
+                iov[n++].iov_len = wrapped * BLOCK_BYTES;
+            }
+        }
+        if (n == 0) {
+            return 1;
+        }
+
+        /* Send without blocking, and wait for EPOLLOUT if it didn't all fit */
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        if ((sent = sendmsg(c->ep.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->blocked = 1;
+                return 1;
+            }
+            return errno == EINTR;
+        }
+        bytes_sent += sent;
+
+        /* Account for what was sent */
+        if (c->header_sent < c->header_length) {
+            int part = c->header_length - c->header_sent;
+            part = sent < part ? (int) sent : part;
+            c->header_sent += part;
+            sent -= part;
+        }
+        sent += c->offset;
+        c->seq += sent / BLOCK_BYTES;
+        c->offset = sent % BLOCK_BYTES;
+    }
+    return 1;
+}
+
+/* Read the request line ("<station>\n") from a new client. Returns 0 if */
+/* the connection should be dropped. */
+static int read_request(client *c)
+{
+    for (;;) {
+        char *end;
+        station *s;
+        unsigned long head;
+        long index;
+        ssize_t got = read(c->ep.fd, c->request + c->request_length,
+                           MAX_REQUEST - 1 - c->request_length);
+        if (got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        } else if (got == 0) {
+            return 0;
+        }
+        c->request_length += got;
+        c->request[c->request_length] = '\0';
+        if (!(end = strchr(c->request, '\n'))) {
+            if (c->request_length == MAX_REQUEST - 1) {
+                return 0;
+            }
+            continue;
+        }
+
+        /* Look up the station (an empty line picks the first) */
+        *end = '\0';
+        index = strtol(c->request, &end, 10);
+        if ((*end != '\0' && *end != '\r') || index < 0
+         || index >= num_stations) {
+            return 0;
+        }
+        s = &stations[index];
+
+        /* Join the station, starting a little behind the newest block */
+        c->station = s;
+        c->next = s->clients;
+        if (s->clients) {
+            s->clients->prev = c;
+        }
+        s->clients = c;
+        add_listeners(s, 1);
+        sprintf(c->header, "pocketmod s16le %d 2 %.100s\n", SAMPLE_RATE,
+                s->name);
+        c->header_length = (int) strlen(c->header);
+        head = station_head(s);
+        c->seq = head > PREROLL_BLOCKS ? head - PREROLL_BLOCKS : 0;
+        return flush_client(c, head);
+    }
+}
+
+/* Accept all pending connections on a listening socket */
+static void accept_clients(int epoll_fd, int listen_fd)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+        struct epoll_event event;
+        client *c = calloc(1, sizeof(client));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->ep.kind = ENDPOINT_CLIENT;
+        c->ep.fd = fd;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+/* Hand out newly rendered blocks to every listener that isn't blocked */
+static void fan_out(void)
+{
+    int i;
+    for (i = 0; i < num_stations; i++) {
+        station *s = &stations[i];
+        client *c, *next;
+        unsigned long head = station_head(s);
+        if (head == s->sent) {
+            continue;
+        }
+        s->sent = head;
+        for (c = s->clients; c; c = next) {
+            next = c->next;
+            if (!flush_client(c, head)) {
+                drop_client(c);
+            }
+        }
+    }
+}
+
+/* Open a listening TCP socket on the loopback interface */
+static int listen_tcp(int port)
+{
+    struct sockaddr_in addr;
+    int fd, yes = 1;
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))
+     || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Open a listening Unix domain socket, replacing any old one at 'path' */
+static int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path)
+     || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr))
+     || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Load a song and start its render thread (returns 0 on error) */
+static int open_station(station *s, const char *filename)
+{
+    const char *slash;
+    long size;
+    int bytes;
+    if (!(s->data = read_file(filename, &size))) {
+        printf("error: can't read file '%s'\n", filename);
+        return 0;
+    }
+
+    /* A context that only has room for the song's own channels */
+    bytes = pocketmod_context_size(s->data, size);
+    if (!bytes || !(s->context = malloc(bytes))
+     || !pocketmod_init(s->context, s->data, size, SAMPLE_RATE)) {
+        printf("error: '%s' is not a valid MOD file\n", filename);
+        return 0;
+    } else if (!(s->ring = malloc(RING_BLOCKS * BLOCK_BYTES))) {
+        printf("error: can't allocate ring buffer\n");
+        return 0;
+    }
+    s->name = filename;
+    while ((slash = strpbrk(s->name, "/\\"))) {
+        s->name = slash + 1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (pthread_create(&s->thread, NULL, render_thread, s)) {
+        printf("error: can't create render thread\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Stop a station's render thread and free its resources */
+static void close_station(station *s)
+{
+    client *c;
+    while ((c = s->clients)) {
+        drop_client(c);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    free(s->ring);
+    free(s->context);
+    free(s->data);
+}
+
+/* Print listener count, throughput and CPU use since the last status line */
+static void show_status(double seconds, double cpu, unsigned long long bytes)
+{
+    double usage = 100.0 * cpu / seconds;
+    printf("%d listeners, %.1f MB/s sent, CPU %.2f%%", num_listeners,
+           bytes / seconds / 1000000.0, usage);
+    if (num_listeners > 0) {
+        printf(" (%.4f%% per listener)", usage / num_listeners);
+    }
+    printf(", %lu overruns\n", overruns);
+    fflush(stdout);
+}
+
+static void handle_signal(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+    static struct epoll_event events[MAX_EVENTS];
+    endpoint tcp = { ENDPOINT_LISTENER, -1 };
+    endpoint local = { ENDPOINT_LISTENER, -1 };
+    endpoint wakeup = { ENDPOINT_WAKEUP, -1 };
+    struct epoll_event event;
+    const char *socket_path = NULL;
+    int i, epoll_fd, port = DEFAULT_PORT, started = 0, result = 0;
+    double last_time, last_cpu;
+    unsigned long long last_bytes = 0;
+
+    /* Parse options */
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-p")) {
+            if ((port = atoi(argv[2])) < 0 || port > 65535) {
+                printf("error: invalid port '%s'\n", argv[2]);
+                return -1;
+            }
+        } else if (!strcmp(argv[1], "-u")) {
+            socket_path = argv[2];
+        } else {
+            break;
+        }
+        argv[2] = argv[0]; /* Keep the program name in argv[0] */
+        argc -= 2;
+        argv += 2;
+    }
+
+    /* Print usage if no file was given */
+    if (argc < 2 || argv[1][0] == '-') {
+        printf("usage: %s [-p port] [-u socket] <infile>...\n", argv[0]);
+        return -1;
+    }
+
+    /* Set up the sockets. Port 0 turns off TCP. */
+    if ((epoll_fd = epoll_create1(0)) == -1
+     || (wakeup.fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        printf("error: can't create epoll instance\n");
+        return -1;
+    } else if (port && (tcp.fd = listen_tcp(port)) == -1) {
+        printf("error: can't listen on port %d\n", port);
+        return -1;
+    } else if (socket_path && (local.fd = listen_unix(socket_path)) == -1) {
+        printf("error: can't listen on '%s'\n", socket_path);
+        return -1;
+    } else if (tcp.fd == -1 && local.fd == -1) {
+        printf("error: no socket to listen on\n");
+        return -1;
+    }
+    wakeup_fd = wakeup.fd;
+    event.events = EPOLLIN;
+    event.data.ptr = &wakeup;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup.fd, &event);
+    event.data.ptr = &tcp;
+    if (tcp.fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp.fd, &event);
+    }
+    event.data.ptr = &local;
+    if (local.fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, local.fd, &event);
+    }
+
+    /* Start a station for each song */
+    num_stations = argc - 1;
+    if (!(stations = calloc(num_stations, sizeof(station)))) {
+        printf("error: can't allocate stations\n");
+        return -1;
+    }
+    for (i = 0; i < num_stations; i++, started++) {
+        if (!open_station(&stations[i], argv[i + 1])) {
+            result = -1;
+            break;
+        }
+        printf("Station %d: '%s'\n", i, stations[i].name);
+    }
+    if (tcp.fd != -1) {
+        printf("Listening on 127.0.0.1:%d\n", port);
+    }
+    if (socket_path) {
+        printf("Listening on '%s'\n", socket_path);
+    }
+    printf("Press Ctrl + C to stop\n");
+    fflush(stdout);
+
+    /* Run the event loop until interrupted */
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    last_time = wall_time();
+    last_cpu = cpu_time();
+    while (result == 0 && !stopping) {
+        double now;
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (count == -1 && errno != EINTR) {
+            printf("error: epoll_wait failed\n");
+            result = -1;
+        }
+        for (i = 0; i < count; i++) {
+            endpoint *ep = events[i].data.ptr;
+            if (ep->kind == ENDPOINT_LISTENER) {
+                accept_clients(epoll_fd, ep->fd);
+            } else if (ep->kind == ENDPOINT_WAKEUP) {
+                unsigned long long value;
+                if (read(ep->fd, &value, sizeof(value)) > 0) {
+                    fan_out();
+                }
+            } else {
+                client *c = (client*) ep;
+                int ok = 1;
+                if (c->dropped) {
+                    continue;
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    ok = 0;
+                } else if (!c->station && (events[i].events & EPOLLIN)) {
+                    ok = read_request(c);
+                } else if (c->station && (events[i].events & EPOLLIN)) {
+                    /* Listeners have nothing more to say: EOF or garbage */
+                    char discard[256];
+                    ok = read(ep->fd, discard, sizeof(discard)) != 0;
+                }
+                if (ok && c->station && (events[i].events & EPOLLOUT)) {
+                    c->blocked = 0;
+                    ok = flush_client(c, station_head(c->station));
+                }
+                if (!ok) {
+                    drop_client(c);
+                }
+            }
+        }
+        free_dropped_clients();
+
+        /* Print a status line now and then */
+        if ((now = wall_time()) - last_time >= STATUS_INTERVAL) {
+            double cpu = cpu_time();
+            show_status(now - last_time, cpu - last_cpu,
+                        bytes_sent - last_bytes);
+            last_time = now;
+            last_cpu = cpu;
+            last_bytes = bytes_sent;
+        }
+    }
+
+    /* Tidy up before leaving */
+    printf("\nShutting down\n");
+    for (i = 0; i < started; i++) {
+        close_station(&stations[i]);
+    }
+    free_dropped_clients();
+    free(stations);
+    close(epoll_fd);
+    close(wakeup.fd);
+    if (tcp.fd != -1) {
+        close(tcp.fd);
+    }
+    if (local.fd != -1) {
+        close(local.fd);
+        unlink(socket_path);
+    }
+    return result;
+}
@@ -8,9 +8,59 @@ extern "C" {
 #endif
 
 typedef struct pocketmod_context pocketmod_context;
+int pocketmod_context_size(const void *data, int size);
 int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate);
+int pocketmod_init_partial(pocketmod_context *c, const void *data, int size,
+                           int rate);
+int pocketmod_init_upsampled(pocketmod_context *c, const void *data, int size,
+                             int rate, int factor);
+int pocketmod_append(pocketmod_context *c, int size);
 int pocketmod_render(pocketmod_context *c, void *buffer, int size);
 int pocketmod_loop_count(pocketmod_context *c);
+int pocketmod_set_quality(pocketmod_context *c, int quality);
+int pocketmod_cache(pocketmod_context *c, void *memory, int size);
+int pocketmod_set_budget(pocketmod_context *c, unsigned long (*clock)(void*),
+                         void *data, unsigned long budget);
+int pocketmod_degradation(pocketmod_context *c);
+int pocketmod_find_loop(const void *data, int size, int rate, int max_frames,
+                        int *intro, int *length);
+int pocketmod_save_state(pocketmod_context *c, void *buffer, int size);
+int pocketmod_load_state(pocketmod_context *c, const void *buffer, int size);
+
+typedef struct pocketmod_meter pocketmod_meter;
+int pocketmod_set_meter(pocketmod_context *c, pocketmod_meter *meter);
+
+typedef struct pocketmod_info pocketmod_info;
+int pocketmod_probe(const void *data, int size, pocketmod_info *info);
+
+typedef struct pocketmod_archive_entry pocketmod_archive_entry;
+int pocketmod_archive_count(const void *archive, int size);
+int pocketmod_archive_get(const void *archive, int size, int index,
+                          pocketmod_archive_entry *entry);
+int pocketmod_archive_init(pocketmod_context *c, const void *archive, int size,
+                           int index, int rate);
+
+/* Resampling qualities for pocketmod_set_quality() */
+#define POCKETMOD_QUALITY_DEFAULT 0 /* Linear (or nearest, see below)   */
+#define POCKETMOD_QUALITY_CUBIC 1   /* 4-point cubic (Catmull-Rom)      */
+#define POCKETMOD_QUALITY_SINC8 2   /* 8-tap windowed sinc              */
+#define POCKETMOD_QUALITY_SINC16 3  /* 16-tap windowed sinc             */
+
+/* Degradation levels reported by pocketmod_degradation() */
+#define POCKETMOD_DEGRADE_NONE 0    /* Full quality                      */
+#define POCKETMOD_DEGRADE_NEAREST 1 /* Quiet voices use nearest samples  */
+#define POCKETMOD_DEGRADE_SKIP 2    /* ...inaudible voices aren't mixed  */
+#define POCKETMOD_DEGRADE_SHORT 3   /* ...and renders can stop early     */
+
+/* Voice levels (0..64, volume times the louder side of the balance) below */
+/* which voices count as quiet and inaudible when degrading */
+#ifndef POCKETMOD_QUIET_LEVEL
+#define POCKETMOD_QUIET_LEVEL 16
+#endif
+
+#ifndef POCKETMOD_INAUDIBLE_LEVEL
+#define POCKETMOD_INAUDIBLE_LEVEL 2
+#endif
 
 #ifndef POCKETMOD_MAX_CHANNELS
 #define POCKETMOD_MAX_CHANNELS 32
@@ -25,21 +75,27 @@ typedef struct {
     unsigned int length;        /* Data length (in bytes)                  */
 } _pocketmod_sample;
 
+/* Voice state. The fields the mixer reads for every sample come first, */
+/* and the effect parameter memory, which is only touched when an effect */
+/* starts, comes last. */
 typedef struct {
-    unsigned char dirty;        /* Pitch/volume dirty flags                */
+    float position;             /* Position in sample data buffer          */
+    float increment;            /* Position increment per output sample    */
     unsigned char sample;       /* Sample number (0..31)                   */
-    unsigned char volume;       /* Base volume without tremolo (0..64)     */
     unsigned char balance;      /* Stereo balance (0..255)                 */
+    unsigned char real_volume;  /* Volume (with tremolo adjustment)        */
+    unsigned char dirty;        /* Pitch/volume dirty flags                */
     unsigned short period;      /* Note period (113..856)                  */
     unsigned short delayed;     /* Delayed note period (113..856)          */
     unsigned short target;      /* Target period (for tone portamento)     */
+    unsigned char volume;       /* Base volume without tremolo (0..64)     */
     unsigned char finetune;     /* Note finetune (0..15)                   */
-    unsigned char loop_count;   /* E6x loop counter                        */
-    unsigned char loop_line;    /* E6x target line                         */
     unsigned char lfo_step;     /* Vibrato/tremolo LFO step counter        */
     unsigned char lfo_type[2];  /* LFO type for vibrato/tremolo            */
     unsigned char effect;       /* Current effect (0x0..0xf or 0xe0..0xef) */
     unsigned char param;        /* Raw effect parameter value              */
+    unsigned char loop_count;   /* E6x loop counter                        */
+    unsigned char loop_line;    /* E6x target line                         */
     unsigned char param3;       /* Parameter memory for 3xx                */
     unsigned char param4;       /* Parameter memory for 4xy                */
     unsigned char param7;       /* Parameter memory for 7xy                */
@@ -48,11 +104,11 @@ typedef struct {
     unsigned char paramE2;      /* Parameter memory for E2x                */
     unsigned char paramEA;      /* Parameter memory for EAx                */
     unsigned char paramEB;      /* Parameter memory for EBx                */
-    unsigned char real_volume;  /* Volume (with tremolo adjustment)        */
-    float position;             /* Position in sample data buffer          */
-    float increment;            /* Position increment per output sample    */
 } _pocketmod_chan;
 
+/* The state used while mixing is kept together at the end, and the channel */
+/* array comes last so that a context can be cut short after the channels */
+/* a song actually has (see pocketmod_context_size()) */
 struct pocketmod_context
 {
     /* Read-only song data */
@@ -66,25 +122,79 @@ struct pocketmod_context
     unsigned char num_samples;  /* Sample count (15 or 31)                 */
     unsigned char num_channels; /* Channel count (1..32)                   */
 
-    /* Timing variables */
-    int samples_per_second;     /* Sample rate (set by user)               */
-    int ticks_per_line;         /* A.K.A. song speed (initially 6)         */
-    float samples_per_tick;     /* Depends on sample rate and BPM          */
+    /* Progressive loading state */
+    int loaded;                 /* Bytes of MOD data available so far      */
+    unsigned int pending;       /* Bit mask of samples not yet available   */
 
     /* Loop detection state */
     unsigned char visited[16];  /* Bit mask of previously visited patterns */
     int loop_count;             /* How many times the song has looped      */
 
-    /* Render state */
-    _pocketmod_chan channels[POCKETMOD_MAX_CHANNELS];
-    unsigned char pattern_delay;/* EEx pattern delay counter               */
-    unsigned int lfo_rng;       /* RNG used for the random LFO waveform    */
+    /* Optional features (set by user) */
+    void *cache;                /* Render cache set by pocketmod_cache()   */
+    pocketmod_meter *meter;     /* Level meter set by pocketmod_set_meter()*/
+    unsigned long (*clock)(void*); /* Time source for the CPU budget      */
+    void *clock_data;           /* Argument passed to the time source      */
+    unsigned long budget;       /* Time allowed per render call            */
+    int degrade;                /* Current degradation level (0..3)        */
+    int calm;                   /* Render calls in a row well under budget */
+
+    /* Output settings */
+    int samples_per_second;     /* Sample rate (set by user)               */
+    int quality;                /* Resampling quality (set by user)        */
+    int upsample;               /* Output rate / mixing rate (1, 2 or 4)   */
+    float history[2][15][2];    /* Recent input to each upsampling stage   */
+
+    /* Timing variables */
+    int ticks_per_line;         /* A.K.A. song speed (initially 6)         */
+    float samples_per_tick;     /* Depends on sample rate and BPM          */
 
     /* Position in song (from least to most granular) */
     signed char pattern;        /* Current pattern in order                */
     signed char line;           /* Current line in pattern                 */
     short tick;                 /* Current tick in line                    */
     float sample;               /* Current sample in tick                  */
+
+    /* Render state */
+    unsigned char pattern_delay;/* EEx pattern delay counter               */
+    unsigned int lfo_rng;       /* RNG used for the random LFO waveform    */
+    unsigned int ticks;         /* Ticks played since the start (wraps)    */
+    _pocketmod_chan channels[POCKETMOD_MAX_CHANNELS];
+};
+
+/* Sequencer hooks used by pocketmod_render() and by the specialized mixers */
+/* in pocketmod.hpp. They are not part of the public API. */
+int _pocketmod_span(pocketmod_context *c, int samples_remaining);
+int _pocketmod_advance(pocketmod_context *c, int samples);
+
+struct pocketmod_meter
+{
+    int voices;                 /* Set by user: also meter each channel    */
+    int frames;                 /* Sample frames measured                  */
+    float peak[2];              /* Highest absolute value (left/right)     */
+    float square[2];            /* Sum of squared values (left/right)      */
+    float voice_peak[POCKETMOD_MAX_CHANNELS];   /* Same for each channel,  */
+    float voice_square[POCKETMOD_MAX_CHANNELS]; /* before panning          */
+};
+
+struct pocketmod_info
+{
+    char tag[4];                /* Format tag ("M.K." etc.), zero if none  */
+    int channels;               /* Channel count (1..32)                   */
+    int samples;                /* Sample count (15 or 31)                 */
+    int length;                 /* Patterns in the order (1..128)          */
+    int patterns;               /* Patterns in the file (1..128)           */
+    int file_size;              /* Expected file size in bytes             */
+};
+
+struct pocketmod_archive_entry
+{
+    const char *name;           /* Song name (null-terminated)             */
+    const void *data;           /* MOD file data inside the archive        */
+    int size;                   /* MOD file size in bytes                  */
+    int duration;               /* Song duration in milliseconds           */
+    int channels;               /* Channel count (1..32)                   */
+    char tag[4];                /* Format tag ("M.K." etc.), zero if none  */
 };
 
 #ifdef POCKETMOD_IMPLEMENTATION
@@ -110,6 +220,11 @@ struct pocketmod_context
 /* The size of one sample in bytes */
 #define POCKETMOD_SAMPLE_SIZE sizeof(float[2])
 
+/* Archive layout: a 16-byte header followed by 64-byte index entries */
+#define POCKETMOD_ARCHIVE_HEADER 16
+#define POCKETMOD_ARCHIVE_ENTRY 64
+#define POCKETMOD_ARCHIVE_NAME 44
+
 /* Finetune adjustment table. Three octaves for each finetune setting. */
 static const signed char _pocketmod_finetune[16][36] = {
     {  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0},
@@ -145,10 +260,35 @@ static int _pocketmod_clamp_volume(int x)
 /* Zero out a block of memory */
 static void _pocketmod_zero(void *data, int size)
 {
-    char *byte = data, *end = byte + size;
+    char *byte = (char*) data, *end = byte + size;
     while (byte != end) { *byte++ = 0; }
 }
 
+/* Copy a block of memory */
+static void _pocketmod_copy(void *dst, const void *src, int size)
+{
+    char *to = (char*) dst;
+    const char *from = (const char*) src, *end = from + size;
+    while (from != end) { *to++ = *from++; }
+}
+
+/* Check if two blocks of memory are equal */
+static int _pocketmod_equal(const void *a, const void *b, int size)
+{
+    const char *x = (const char*) a, *y = (const char*) b, *end = x + size;
+    while (x != end) { if (*x++ != *y++) return 0; }
+    return 1;
+}
+
+/* Hash a block of memory (FNV-1a) */
+static unsigned int _pocketmod_hash(const void *data, int size)
+{
+    const unsigned char *byte = (const unsigned char*) data;
+    unsigned int hash = 0x811c9dc5;
+    while (size--) { hash = (hash ^ *byte++) * 0x01000193; }
+    return hash;
+}
+
 /* Convert a period (at finetune = 0) to a note index in 0..35 */
 static int _pocketmod_period_to_note(int period)
 {
@@ -182,19 +322,21 @@ static int _pocketmod_sin(int step)
     return step < 0x20 ? x : -x;
 }
 
-/* Oscillators for vibrato/tremolo effects */
-static int _pocketmod_lfo(pocketmod_context *c, _pocketmod_chan *ch, int step)
+/* Oscillators for vibrato/tremolo effects. 'rng' is the channel's value */
+/* of the LFO random number generator for this tick. */
+static int _pocketmod_lfo(_pocketmod_chan *ch, int step, unsigned int rng)
 {
     switch (ch->lfo_type[ch->effect == 7] & 3) {
         case 0: return _pocketmod_sin(step & 0x3f);         /* Sine   */
         case 1: return 0xff - ((step & 0x3f) << 3);         /* Saw    */
         case 2: return (step & 0x3f) < 0x20 ? 0xff : -0xff; /* Square */
-        case 3: return (c->lfo_rng & 0x1ff) - 0xff;         /* Random */
+        case 3: return (rng & 0x1ff) - 0xff;                /* Random */
         default: return 0; /* Hush little compiler */
     }
 }
 
-static void _pocketmod_update_pitch(pocketmod_context *c, _pocketmod_chan *ch)
+static void _pocketmod_update_pitch(pocketmod_context *c, _pocketmod_chan *ch,
+                                    unsigned int rng)
 {
     /* Don't do anything if the period is zero */
     ch->increment = 0.0f;
@@ -205,7 +347,7 @@ static void _pocketmod_update_pitch(pocketmod_context *c, _pocketmod_chan *ch)
         if (ch->effect == 0x4 || ch->effect == 0x6) {
             int step = (ch->param4 >> 4) * ch->lfo_step;
             int rate = ch->param4 & 0x0f;
-            period += _pocketmod_lfo(c, ch, step) * rate / 128.0f;
+            period += _pocketmod_lfo(ch, step, rng) * rate / 128.0f;
 
         /* Apply arpeggio (if active) */
         } else if (ch->effect == 0x0 && ch->param) {
@@ -227,12 +369,12 @@ static void _pocketmod_update_pitch(pocketmod_context *c, _pocketmod_chan *ch)
     ch->dirty &= ~POCKETMOD_PITCH;
 }
 
-static void _pocketmod_update_volume(pocketmod_context *c, _pocketmod_chan *ch)
+static void _pocketmod_update_volume(_pocketmod_chan *ch, unsigned int rng)
 {
     int volume = ch->volume;
     if (ch->effect == 0x7) {
         int step = ch->lfo_step * (ch->param7 >> 4);
-        volume += _pocketmod_lfo(c, ch, step) * (ch->param7 & 0x0f) >> 6;
+        volume += _pocketmod_lfo(ch, step, rng) * (ch->param7 & 0x0f) >> 6;
     }
     ch->real_volume = _pocketmod_clamp_volume(volume);
     ch->dirty &= ~POCKETMOD_VOLUME;
@@ -431,11 +573,69 @@ static void _pocketmod_next_line(pocketmod_context *c)
     }
 }
 
+/* Handle effects that may happen on any tick of a line */
+static void _pocketmod_any_tick(pocketmod_context *c, _pocketmod_chan *ch)
+{
+    int param = ch->param;
+    switch (ch->effect) {
+
+        /* 0xy: Arpeggio */
+        case 0x0: {
+            ch->dirty |= POCKETMOD_PITCH;
+        } break;
+
+        /* E9x: Retrigger note every x ticks */
+        case 0xE9: {
+            if (!(param && c->tick % param)) {
+                ch->position = 0.0f;
+                ch->lfo_step = 0;
+            }
+        } break;
+
+        /* ECx: Cut note after x ticks */
+        case 0xEC: {
+            if (c->tick == param) {
+                ch->volume = 0;
+                ch->dirty |= POCKETMOD_VOLUME;
+            }
+        } break;
+
+        /* EDx: Delay note for x ticks */
+        case 0xED: {
+            if (c->tick == param && ch->sample) {
+                ch->dirty |= POCKETMOD_VOLUME | POCKETMOD_PITCH;
+                ch->period = ch->delayed;
+                ch->position = 0.0f;
+                ch->lfo_step = 0;
+            }
+        } break;
+
+        default: break;
+    }
+}
+
+/* Advance the LFO random number generator for a channel, then update its */
+/* volume/pitch where either is out of date */
+static void _pocketmod_refresh(pocketmod_context *c, _pocketmod_chan *ch)
+{
+    c->lfo_rng = 0x0019660d * c->lfo_rng + 0x3c6ef35f;
+    if (ch->dirty & POCKETMOD_VOLUME) {
+        _pocketmod_update_volume(ch, c->lfo_rng);
+    }
+    if (ch->dirty & POCKETMOD_PITCH) {
+        _pocketmod_update_pitch(c, ch, c->lfo_rng);
+    }
+}
+
+/* The first tick of a line and the others each get their own loop over the */
+/* channels, so the tick is only tested once and each channel goes through  */
+/* a single switch. Both pass any other effect on to _pocketmod_any_tick(). */
 static void _pocketmod_next_tick(pocketmod_context *c)
 {
     int i;
 
     /* Move to the next line if this was the last tick */
+    c->ticks++;
     if (++c->tick == c->ticks_per_line) {
         if (c->pattern_delay > 0) {
             c->pattern_delay--;
@@ -445,63 +645,25 @@ static void _pocketmod_next_tick(pocketmod_context *c)
         c->tick = 0;
     }
 
-    /* Make per-tick adjustments for all channels */
-    for (i = 0; i < c->num_channels; i++) {
-        _pocketmod_chan *ch = &c->channels[i];
-        int param = ch->param;
-
-        /* Advance the LFO random number generator */
-        c->lfo_rng = 0x0019660d * c->lfo_rng + 0x3c6ef35f;
-
-        /* Handle effects that may happen on any tick of a line */
-        switch (ch->effect) {
-
-            /* 0xy: Arpeggio */
-            case 0x0: {
-                ch->dirty |= POCKETMOD_PITCH;
-            } break;
-
-            /* E9x: Retrigger note every x ticks */
-            case 0xE9: {
-                if (!(param && c->tick % param)) {
-                    ch->position = 0.0f;
-                    ch->lfo_step = 0;
-                }
-            } break;
-
-            /* ECx: Cut note after x ticks */
-            case 0xEC: {
-                if (c->tick == param) {
-                    ch->volume = 0;
-                    ch->dirty |= POCKETMOD_VOLUME;
-                }
-            } break;
-
-            /* EDx: Delay note for x ticks */
-            case 0xED: {
-                if (c->tick == param && ch->sample) {
-                    ch->dirty |= POCKETMOD_VOLUME | POCKETMOD_PITCH;
-                    ch->period = ch->delayed;
-                    ch->position = 0.0f;
-                    ch->lfo_step = 0;
-                }
-            } break;
-
-            default: break;
-        }
-
-        /* Handle effects that only happen on the first tick of a line */
-        if (c->tick == 0) {
+    /* Handle effects that happen on the first tick of a line */
+    if (c->tick == 0) {
+        for (i = 0; i < c->num_channels; i++) {
+            _pocketmod_chan *ch = &c->channels[i];
             switch (ch->effect) {
                 case 0xE1: _pocketmod_pitch_slide(ch, -ch->paramE1); break;
                 case 0xE2: _pocketmod_pitch_slide(ch, +ch->paramE2); break;
                 case 0xEA: _pocketmod_volume_slide(ch, ch->paramEA << 4); break;
                 case 0xEB: _pocketmod_volume_slide(ch, ch->paramEB & 15); break;
-                default: break;
+                default: _pocketmod_any_tick(c, ch); break;
             }
+            _pocketmod_refresh(c, ch);
+        }
 
-        /* Handle effects that are not applied on the first tick of a line */
-        } else {
+    /* Handle effects that are not applied on the first tick of a line */
+    } else {
+        for (i = 0; i < c->num_channels; i++) {
+            _pocketmod_chan *ch = &c->channels[i];
+            int param = ch->param;
             switch (ch->effect) {
 
                 /* 1xx: Portamento up */
@@ -551,72 +713,215 @@ static void _pocketmod_next_tick(pocketmod_context *c)
                     _pocketmod_volume_slide(ch, param);
                 } break;
 
-                default: break;
+                default: _pocketmod_any_tick(c, ch); break;
             }
+            _pocketmod_refresh(c, ch);
         }
+    }
+}
+
+/* Phases per sample in the windowed sinc tables */
+#define POCKETMOD_PHASES 256
+
+/* Windowed sinc kernels for each phase, shared by all contexts and filled */
+/* in by the first call to pocketmod_set_quality() that needs them */
+static float _pocketmod_sinc8[POCKETMOD_PHASES + 1][8];
+static float _pocketmod_sinc16[POCKETMOD_PHASES + 1][16];
+static int _pocketmod_sinc_ready;
+
+/* Sine function for building the sinc tables, so libm isn't needed */
+static double _pocketmod_sine(double x)
+{
+    const double pi = 3.14159265358979323846;
+    double term, sum;
+    int i;
+    while (x > pi) { x -= 2.0 * pi; }
+    while (x < -pi) { x += 2.0 * pi; }
+    term = sum = x;
+    for (i = 1; i < 12; i++) {
+        term *= -x * x / ((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
 
-        /* Update channel volume/pitch if either is out of date */
-        if (ch->dirty & POCKETMOD_VOLUME) { _pocketmod_update_volume(c, ch); }
-        if (ch->dirty & POCKETMOD_PITCH) { _pocketmod_update_pitch(c, ch); }
+/* Fill in a table of Blackman-windowed sinc kernels with 'taps' taps. Each */
+/* kernel is normalized to unity gain, and the first one (for phase 0) has */
+/* a single nonzero tap, so whole sample positions come out unchanged. */
+static void _pocketmod_make_sinc(float *table, int taps)
+{
+    const double pi = 3.14159265358979323846;
+    double kernel[16], sum;
+    int phase, i, half = taps / 2;
+    for (phase = 0; phase <= POCKETMOD_PHASES; phase++) {
+        for (i = 0, sum = 0.0; i < taps; i++) {
+            double x = i + 1 - half - (double) phase / POCKETMOD_PHASES;
+            double a = pi * x / half;
+            double window = 0.42 + 0.5 * _pocketmod_sine(a + pi / 2)
+                          + 0.08 * _pocketmod_sine(2 * a + pi / 2);
+            double sinc = x ? _pocketmod_sine(pi * x) / (pi * x) : 1.0;
+            sum += kernel[i] = window * sinc;
+        }
+        for (i = 0; i < taps; i++) {
+            *table++ = (float) (kernel[i] / sum);
+        }
     }
 }
 
+/* Resample and write up to 'num' samples with a cubic or windowed sinc */
+/* kernel. This is the inner loop of _pocketmod_render_channel() for the */
+/* higher qualities, and steps through the sample in exactly the same way. */
+static int _pocketmod_resample(pocketmod_context *c, _pocketmod_chan *chan,
+                               const signed char *data, int sample_end,
+                               int loop_length, float level_l, float level_r,
+                               float *output, int num)
+{
+    const int taps = c->quality == POCKETMOD_QUALITY_CUBIC ? 4
+                   : c->quality == POCKETMOD_QUALITY_SINC8 ? 8 : 16;
+    const float *table = taps == 8 ? *_pocketmod_sinc8 : *_pocketmod_sinc16;
+    float x[16], w[4];
+    int i, j;
+    for (i = 0; i < num && chan->position < sample_end; i++) {
+        int x0 = (int) chan->position, first = x0 + 1 - taps / 2;
+        float t = chan->position - x0, s = 0.0f;
+        const float *weights = w;
+
+        /* Fetch the data points under the kernel. Near the ends, wrap */
+        /* around the loop or pad with silence instead of reading past */
+        /* the loop or outside the sample. */
+        if (first >= 0 && first + taps <= sample_end) {
+            for (j = 0; j < taps; j++) {
+                x[j] = data[first + j];
+            }
+        } else {
+            for (j = 0; j < taps; j++) {
+                int k = first + j;
+                while (loop_length && k >= sample_end) {
+                    k -= loop_length;
+                }
+                x[j] = k >= 0 && k < sample_end ? data[k] : 0.0f;
+            }
+        }
+
+        /* Calculate (cubic) or look up (sinc) the weights for this phase */
+        if (taps == 4) {
+            w[0] = 0.5f * t * (t * (2.0f - t) - 1.0f);
+            w[1] = 0.5f * (t * t * (3.0f * t - 5.0f) + 2.0f);
+            w[2] = 0.5f * t * (t * (4.0f - 3.0f * t) + 1.0f);
+            w[3] = 0.5f * t * t * (t - 1.0f);
+        } else {
+            weights = table + (int) (t * POCKETMOD_PHASES + 0.5f) * taps;
+        }
+
+        /* Apply the kernel */
+        for (j = 0; j < taps; j++) {
+            s += weights[j] * x[j];
+        }
+        chan->position += chan->increment;
+        *output++ += level_l * s;
+        *output++ += level_r * s;
+    }
+    return i;
+}
+
 static void _pocketmod_render_channel(pocketmod_context *c,
                                       _pocketmod_chan *chan,
                                       float *output,
                                       int samples_to_write)
 {
-    /* Gather some loop data */
+    /* Gather some loop data. A loop that extends past the end of the sample */
+    /* data is never reached, so such samples play once like unlooped ones. */
     _pocketmod_sample *sample = &c->samples[chan->sample - 1];
     unsigned char *data = POCKETMOD_SAMPLE(c, chan->sample);
     const int loop_start = ((data[4] << 8) | data[5]) << 1;
     const int loop_length = ((data[6] << 8) | data[7]) << 1;
     const int loop_end = loop_length > 2 ? loop_start + loop_length : 0xffffff;
-    const float sample_end = 1 + _pocketmod_min(loop_end, sample->length);
+    const int looped = loop_end <= (int) sample->length;
+    const int sample_end = looped ? loop_end : (int) sample->length;
+#ifndef POCKETMOD_NO_INTERPOLATION
+    const int wrap = looped ? loop_length : 1; /* Hold the last data point */
+#endif
 
-    /* Calculate left/right levels */
-    const float volume = chan->real_volume / (float) (128 * 64 * 4);
+    /* Calculate left/right levels. A sample whose data hasn't arrived yet */
+    /* plays silently, but keeps its place. */
+    const int pending = (c->pending >> (chan->sample - 1)) & 1;
+    const float volume = pending ? 0.0f
+                       : chan->real_volume / (float) (128 * 64 * 4);
     const float level_l = volume * (1.0f - chan->balance / 255.0f);
     const float level_r = volume * (0.0f + chan->balance / 255.0f);
 
+    /* When over the CPU budget, quiet voices are resampled more cheaply, */
+    /* and inaudible ones only move along (see pocketmod_set_budget()). */
+    /* Pending voices always just move along, since their data isn't there. */
+    const int louder = _pocketmod_max(chan->balance, 255 - chan->balance);
+    const int loudness = volume == 0.0f ? 0 : chan->real_volume * louder / 255;
+    const int nearest = c->degrade >= POCKETMOD_DEGRADE_NEAREST
+                     && loudness < POCKETMOD_QUIET_LEVEL;
+    const int skip = pending || (c->degrade >= POCKETMOD_DEGRADE_SKIP
+                                 && loudness < POCKETMOD_INAUDIBLE_LEVEL);
+
     /* Write samples */
-    int i, num;
-    do {
+    int i;
+    if (chan->increment <= 0.0f) {
+        return;
+    }
+    while (samples_to_write > 0) {
 
         /* Calculate how many samples we can write in one go */
-        num = (sample_end - chan->position) / chan->increment;
-        num = _pocketmod_min(num, samples_to_write);
-
-        /* Resample and write 'num' samples */
-        for (i = 0; i < num; i++) {
-            int x0 = chan->position;
+        float estimate = (sample_end - chan->position) / chan->increment;
+        int num = estimate < samples_to_write ? (int) estimate + 1
+                                              : samples_to_write;
+
+        /* Resample and write up to 'num' samples. Rounding errors can make */
+        /* the estimate off by one, so also stop when reaching the end. */
+        if (skip) {
+            for (i = 0; i < num && chan->position < sample_end; i++) {
+                chan->position += chan->increment;
+            }
+            output += 2 * i;
+        } else if (nearest) {
+            for (i = 0; i < num && chan->position < sample_end; i++) {
+                float s = sample->data[(int) chan->position];
+                chan->position += chan->increment;
+                *output++ += level_l * s;
+                *output++ += level_r * s;
+            }
+        } else if (c->quality != POCKETMOD_QUALITY_DEFAULT) {
+            i = _pocketmod_resample(c, chan, sample->data, sample_end,
+                                    looped ? loop_length : 0, level_l, level_r,
+                                    output, num);
+            output += 2 * i;
+        } else {
+            for (i = 0; i < num && chan->position < sample_end; i++) {
+                int x0 = chan->position;
 #ifdef POCKETMOD_NO_INTERPOLATION
-            float s = sample->data[x0];
+                float s = sample->data[x0];
 #else
-            int x1 = x0 + 1 - loop_length * (x0 + 1 >= loop_end);
-            float t = chan->position - x0;
-            float s = (1.0f - t) * sample->data[x0] + t * sample->data[x1];
+                int x1 = x0 + 1 - wrap * (x0 + 1 >= sample_end);
+                float t = chan->position - x0;
+                float s = (1.0f - t) * sample->data[x0] + t * sample->data[x1];
 #endif
-            chan->position += chan->increment;
-            *output++ += level_l * s;
-            *output++ += level_r * s;
+                chan->position += chan->increment;
+                *output++ += level_l * s;
+                *output++ += level_r * s;
+            }
         }
-
-        /* Rewind the sample when reaching the loop point */
-        if (chan->position >= loop_end) {
+        samples_to_write -= i;
+
+        /* Rewind the sample when reaching the loop point, or cut it if the */
+        /* end is reached */
+        if (chan->position >= sample_end) {
+            if (!looped) {
+                chan->position = -1.0f;
+                break;
+            }
             chan->position -= loop_length;
-
-        /* Cut the sample if the end is reached */
-        } else if (chan->position >= sample->length) {
-            chan->position = -1.0f;
-            break;
         }
-
-        samples_to_write -= num;
-    } while (num > 0);
+    }
 }
 
-static int _pocketmod_ident(pocketmod_context *c, unsigned char *data, int size)
+static int _pocketmod_ident(const unsigned char *data, int size,
+                            pocketmod_info *info)
 {
     int i, j;
 
@@ -624,7 +929,7 @@ static int _pocketmod_ident(pocketmod_context *c, unsigned char *data, int size)
     if (size >= 1084) {
 
         /* The format tag is located at offset 1080 */
-        unsigned char *tag = data + 1080;
+        const unsigned char *tag = data + 1080;
 
         /* List of recognized format tags (possibly incomplete) */
         static const struct {
@@ -649,12 +954,11 @@ static int _pocketmod_ident(pocketmod_context *c, unsigned char *data, int size)
         for (i = 0; i < (int) (sizeof(tags) / sizeof(*tags)); i++) {
             if (tags[i].name[0] == tag[0] && tags[i].name[1] == tag[1]
              && tags[i].name[2] == tag[2] && tags[i].name[3] == tag[3]) {
-                c->num_channels = tags[i].channels;
-                c->length = data[950];
-                c->reset = data[951];
-                c->order = &data[952];
-                c->patterns = &data[1084];
-                c->num_samples = 31;
+                for (j = 0; j < 4; j++) {
+                    info->tag[j] = tag[j];
+                }
+                info->channels = tags[i].channels;
+                info->samples = 31;
                 return 1;
             }
         }
@@ -683,71 +987,72 @@ static int _pocketmod_ident(pocketmod_context *c, unsigned char *data, int size)
     }
 
     /* It looks like we have an older 15-instrument MOD */
-    c->length = data[470];
-    c->reset = data[471];
-    c->order = &data[472];
-    c->patterns = &data[600];
-    c->num_samples = 15;
-    c->num_channels = 4;
+    for (j = 0; j < 4; j++) {
+        info->tag[j] = 0;
+    }
+    info->channels = 4;
+    info->samples = 15;
     return 1;
 }
 
-int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate)
+/* Offsets of the song length byte, the order table and the pattern data */
+#define POCKETMOD_LENGTH_OFFSET(samples) (20 + 30 * (samples))
+#define POCKETMOD_ORDER_OFFSET(samples) (22 + 30 * (samples))
+#define POCKETMOD_PATTERN_OFFSET(samples) ((samples) == 31 ? 1084 : 600)
+
+/* Bytes of a context needed for a song with the given channel count */
+#define POCKETMOD_CONTEXT_SIZE(channels) ((int) (sizeof(pocketmod_context) \
+    - (POCKETMOD_MAX_CHANNELS - (channels)) * sizeof(_pocketmod_chan)))
+
+int pocketmod_probe(const void *data, int size, pocketmod_info *info)
 {
-    int i, remaining, header_bytes, pattern_bytes;
-    unsigned char *byte = (unsigned char*) c;
-    signed char *sample_data;
+    const unsigned char *byte = (const unsigned char*) data, *order;
+    int i, header_bytes, pattern_bytes;
 
     /* Check that arguments look more or less sane */
-    if (!c || !data || rate <= 0 || size <= 0) {
+    if (!data || !info || size <= 0) {
         return 0;
     }
 
-    /* Zero out the whole context and identify the MOD type */
-    _pocketmod_zero(c, sizeof(pocketmod_context));
-    c->source = (unsigned char*) data;
-    if (!_pocketmod_ident(c, c->source, size)) {
+    /* Identify the MOD type */
+    if (!_pocketmod_ident(byte, size, info)) {
         return 0;
     }
 
     /* Check that we are compiled with support for enough channels */
-    if (c->num_channels > POCKETMOD_MAX_CHANNELS) {
+    if (info->channels > POCKETMOD_MAX_CHANNELS) {
         return 0;
     }
 
     /* Check that we have enough sample slots for this file */
     if (POCKETMOD_MAX_SAMPLES < 31) {
-        byte = (unsigned char*) data + 20;
-        for (i = 0; i < c->num_samples; i++) {
-            unsigned int length = 2 * ((byte[22] << 8) | byte[23]);
-            if (i >= POCKETMOD_MAX_SAMPLES && length > 2) {
+        for (i = POCKETMOD_MAX_SAMPLES; i < info->samples; i++) {
+            const unsigned char *sample = byte + 20 + 30 * i;
+            unsigned int length = 2 * ((sample[22] << 8) | sample[23]);
+            if (length > 2) {
                 return 0; /* Can't fit this sample */
             }
-            byte += 30;
         }
     }
 
     /* Check that the song length is in valid range (1..128) */
-    if (c->length == 0 || c->length > 128) {
+    info->length = byte[POCKETMOD_LENGTH_OFFSET(info->samples)];
+    if (info->length == 0 || info->length > 128) {
         return 0;
     }
 
-    /* Make sure that the reset pattern doesn't take us out of bounds */
-    if (c->reset >= c->length) {
-        c->reset = 0;
-    }
-
     /* Count how many patterns there are in the file */
-    c->num_patterns = 0;
-    for (i = 0; i < 128 && c->order[i] < 128; i++) {
-        c->num_patterns = _pocketmod_max(c->num_patterns, c->order[i]);
+    order = byte + POCKETMOD_ORDER_OFFSET(info->samples);
+    info->patterns = 0;
+    for (i = 0; i < 128 && order[i] < 128; i++) {
+        info->patterns = _pocketmod_max(info->patterns, order[i]);
     }
-    pattern_bytes = 256 * c->num_channels * ++c->num_patterns;
-    header_bytes = (int) ((char*) c->patterns - (char*) data);
+    pattern_bytes = 256 * info->channels * ++info->patterns;
+    header_bytes = POCKETMOD_PATTERN_OFFSET(info->samples);
 
     /* Check that each pattern in the order is within file bounds */
-    for (i = 0; i < c->length; i++) {
-        if (header_bytes + 256 * c->num_channels * c->order[i] > size) {
+    for (i = 0; i < info->length; i++) {
+        if (header_bytes + 256 * info->channels * order[i] > size) {
             return 0; /* Reading this pattern would be a buffer over-read! */
         }
     }
@@ -757,10 +1062,58 @@ int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate)
         return 0;
     }
 
+    /* Add up the sample payload sizes to get the expected file size */
+    info->file_size = header_bytes + pattern_bytes;
+    for (i = 0; i < info->samples; i++) {
+        const unsigned char *sample = byte + 42 + 30 * i;
+        unsigned int length = ((sample[0] << 8) | sample[1]) << 1;
+        info->file_size += length > 2 ? length : 0;
+    }
+    return 1;
+}
+
+int pocketmod_context_size(const void *data, int size)
+{
+    pocketmod_info info;
+    return pocketmod_probe(data, size, &info)
+         ? POCKETMOD_CONTEXT_SIZE(info.channels) : 0;
+}
+
+int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate)
+{
+    int i, remaining, header_bytes, pattern_bytes;
+    signed char *sample_data;
+    pocketmod_info info;
+
+    /* Check that arguments look more or less sane, and validate the file */
+    if (!c || rate <= 0 || !pocketmod_probe(data, size, &info)) {
+        return 0;
+    }
+
+    /* Zero out the context and fill in the song layout. Only the channels */
+    /* the song uses are touched, so 'c' may be a shortened context. */
+    _pocketmod_zero(c, POCKETMOD_CONTEXT_SIZE(info.channels));
+    c->source = (unsigned char*) data;
+    c->num_channels = info.channels;
+    c->num_samples = info.samples;
+    c->num_patterns = info.patterns;
+    c->length = info.length;
+    c->reset = c->source[POCKETMOD_LENGTH_OFFSET(info.samples) + 1];
+    c->order = c->source + POCKETMOD_ORDER_OFFSET(info.samples);
+    c->patterns = c->source + POCKETMOD_PATTERN_OFFSET(info.samples);
+    c->loaded = size;
+
+    /* Make sure that the reset pattern doesn't take us out of bounds */
+    if (c->reset >= c->length) {
+        c->reset = 0;
+    }
+
     /* Load sample payload data, truncating ones that extend outside the file */
+    pattern_bytes = 256 * c->num_channels * c->num_patterns;
+    header_bytes = (int) ((char*) c->patterns - (char*) data);
     remaining = size - header_bytes - pattern_bytes;
     sample_data = (signed char*) data + header_bytes + pattern_bytes;
-    for (i = 0; i < c->num_samples; i++) {
+    for (i = 0; i < c->num_samples && i < POCKETMOD_MAX_SAMPLES; i++) {
         unsigned char *data = POCKETMOD_SAMPLE(c, i + 1);
         unsigned int length = ((data[0] << 8) | data[1]) << 1;
         _pocketmod_sample *sample = &c->samples[i];
@@ -778,6 +1131,7 @@ int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate)
     /* Prepare to render from the start */
     c->ticks_per_line = 6;
     c->samples_per_second = rate;
+    c->upsample = 1;
     c->samples_per_tick = rate / 50.0f;
     c->lfo_rng = 0xbadc0de;
     c->line = -1;
@@ -786,47 +1140,582 @@ int pocketmod_init(pocketmod_context *c, const void *data, int size, int rate)
     return 1;
 }
 
+int pocketmod_init_upsampled(pocketmod_context *c, const void *data, int size,
+                             int rate, int factor)
+{
+    /* Mix at the lower rate, and let pocketmod_render() upsample the mix */
+    if ((factor != 1 && factor != 2 && factor != 4) || rate % factor != 0
+     || !pocketmod_init(c, data, size, rate / factor)) {
+        return 0;
+    }
+    c->upsample = factor;
+    return 1;
+}
+
+int pocketmod_init_partial(pocketmod_context *c, const void *data, int size,
+                           int rate)
+{
+    pocketmod_info info;
+
+    /* Lay out the samples as if the whole file had arrived already */
+    if (!pocketmod_probe(data, size, &info)
+     || !pocketmod_init(c, data, _pocketmod_max(size, info.file_size), rate)) {
+        return 0;
+    }
+
+    /* Then mark them all as pending, and count what's actually there */
+    c->loaded = 0;
+    c->pending = (1u << _pocketmod_min(c->num_samples,
+                                       POCKETMOD_MAX_SAMPLES)) - 1;
+    pocketmod_append(c, size);
+    return 1;
+}
+
+int pocketmod_append(pocketmod_context *c, int size)
+{
+    const signed char *end;
+    int i, missing = 0;
+    c->loaded += size;
+    end = (const signed char*) c->source + c->loaded;
+
+    /* Enable the samples that are now complete, and work out how many */
+    /* bytes it will take to complete the rest */
+    for (i = 0; i < c->num_samples && i < POCKETMOD_MAX_SAMPLES; i++) {
+        _pocketmod_sample *sample = &c->samples[i];
+        int gap = (int) (sample->data + sample->length - end);
+        if (gap <= 0) {
+            c->pending &= ~(1u << i);
+        }
+        missing = _pocketmod_max(missing, gap);
+    }
+    return missing;
+}
+
+/* Check if a channel's pitch, volume and sample position stay the same on */
+/* a tick that is not the first tick of a line. Errs on the side of "no". */
+static int _pocketmod_quiet(_pocketmod_chan *ch, int tick)
+{
+    switch (ch->effect) {
+        case 0x0: return ch->param == 0; /* Arpeggio */
+        case 0x1: case 0x2: case 0x3: case 0x4:
+        case 0x5: case 0x6: case 0x7: case 0xA: return 0;
+        case 0xE9: return ch->param && tick % ch->param;
+        case 0xEC: case 0xED: return tick != ch->param;
+        default: return 1;
+    }
+}
+
+int _pocketmod_span(pocketmod_context *c, int samples_remaining)
+{
+    float sample = c->sample;
+    int i, tick, num, total = 0;
+    for (tick = c->tick + 1;; tick++) {
+
+        /* Calculate the number of samples left in this tick */
+        num = (int) (c->samples_per_tick - sample);
+        num = _pocketmod_min(num + !num, samples_remaining - total);
+        total += num;
+
+        /* Stop at the end of the buffer or the line, since a new line can */
+        /* change anything */
+        if ((sample += num) < c->samples_per_tick
+         || total == samples_remaining || tick >= c->ticks_per_line) {
+            break;
+        }
+        sample -= c->samples_per_tick;
+
+        /* Otherwise, carry on mixing into the next tick if it won't change */
+        /* any voices. The sequencer catches up in _pocketmod_advance(). */
+        for (i = 0; i < c->num_channels; i++) {
+            if (!_pocketmod_quiet(&c->channels[i], tick)) {
+                return total;
+            }
+        }
+    }
+    return total;
+}
+
+/* Increment the loop counter on reaching a previously visited pattern */
+static void _pocketmod_check_loop(pocketmod_context *c)
+{
+    if (c->visited[c->pattern >> 3] & (1 << (c->pattern & 7))) {
+        _pocketmod_zero(c->visited, sizeof(c->visited));
+        c->loop_count++;
+    }
+}
+
+int _pocketmod_advance(pocketmod_context *c, int samples)
+{
+    while (samples > 0) {
+
+        /* Advance song position by the rest of this tick at most */
+        int num = (int) (c->samples_per_tick - c->sample);
+        num = _pocketmod_min(num + !num, samples);
+        samples -= num;
+        if ((c->sample += num) >= c->samples_per_tick) {
+            c->sample -= c->samples_per_tick;
+            _pocketmod_next_tick(c);
+
+            /* Stop if a new pattern was reached */
+            if (c->line == 0 && c->tick == 0) {
+                _pocketmod_check_loop(c);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Render state captured by the cache at the start of a pattern. The rest */
+/* of the context is either constant or dealt with separately. */
+typedef struct {
+    _pocketmod_chan channels[POCKETMOD_MAX_CHANNELS];
+    float samples_per_tick;
+    float sample;
+    int ticks_per_line;
+    unsigned char pattern_delay;
+} _pocketmod_state;
+
+/* A cached stretch of audio from the start of one pattern to the next.    */
+/* A pattern without jumps (Bxx, or Dxx to a line other than 0) depends    */
+/* only on its own data and on the first line of the pattern after it, so */
+/* it can be reused wherever it appears in the order. Patterns with jumps, */
+/* or followed by a pattern that jumps or breaks on its first line, are    */
+/* tied to one order position. */
+typedef struct {
+    unsigned int hash;          /* Hash of the key and start state         */
+    int order;                  /* Start order position, or -1 for any     */
+    unsigned char pattern;      /* Pattern played                          */
+    unsigned char next;         /* Following pattern (if 'order' is -1)    */
+    unsigned char end;          /* Order position at the end               */
+    unsigned int lfo_rng;       /* Start RNG state (if the song uses it)   */
+    unsigned int ticks;         /* Ticks played during the stretch         */
+    int samples;                /* Samples rendered during the stretch     */
+    _pocketmod_state start;     /* State at the start                      */
+    _pocketmod_state finish;    /* State at the end                        */
+} _pocketmod_cache_entry;       /* Followed by the rendered samples        */
+
+/* Cache bookkeeping, kept at the start of the caller's memory block */
+typedef struct {
+    int size;                   /* Size of the whole memory block          */
+    int used;                   /* Bytes used by complete entries (+ this) */
+    int entries;                /* Number of complete entries              */
+    unsigned char jumps[32];    /* Bit mask of patterns with jumps         */
+    unsigned char uses_rng;     /* Song uses the random LFO waveform       */
+    unsigned char at_start;     /* Positioned at the start of a pattern    */
+    unsigned char order;        /* Order position when recording started   */
+    _pocketmod_cache_entry *recording; /* Entry being recorded, or null    */
+    _pocketmod_cache_entry *playing;   /* Entry being played back, or null */
+    int position;               /* Samples recorded/played so far          */
+    unsigned int ticks;         /* Tick counter when recording started     */
+} _pocketmod_cache;
+
+/* Size of a cache entry header, and of a whole entry */
+#define POCKETMOD_ENTRY_HEADER \
+    ((int) ((sizeof(_pocketmod_cache_entry) + 7) & ~7))
+#define POCKETMOD_ENTRY_SIZE(samples) \
+    (POCKETMOD_ENTRY_HEADER + (samples) * (int) POCKETMOD_SAMPLE_SIZE)
+
+/* Rendered samples stored after a cache entry header */
+#define POCKETMOD_ENTRY_DATA(entry) \
+    ((float(*)[2]) ((char*) (entry) + POCKETMOD_ENTRY_HEADER))
+
+static void _pocketmod_capture(pocketmod_context *c, _pocketmod_state *s)
+{
+    _pocketmod_zero(s, sizeof(_pocketmod_state));
+    _pocketmod_copy(s->channels, c->channels,
+                    c->num_channels * sizeof(_pocketmod_chan));
+    s->samples_per_tick = c->samples_per_tick;
+    s->sample = c->sample;
+    s->ticks_per_line = c->ticks_per_line;
+    s->pattern_delay = c->pattern_delay;
+}
+
+static void _pocketmod_restore(pocketmod_context *c, _pocketmod_state *s)
+{
+    _pocketmod_copy(c->channels, s->channels,
+                    c->num_channels * sizeof(_pocketmod_chan));
+    c->samples_per_tick = s->samples_per_tick;
+    c->sample = s->sample;
+    c->ticks_per_line = s->ticks_per_line;
+    c->pattern_delay = s->pattern_delay;
+}
+
+/* The order position after 'pattern' */
+static int _pocketmod_next_order(pocketmod_context *c, int pattern)
+{
+    return pattern + 1 < c->length ? pattern + 1 : c->reset;
+}
+
+/* Advance the LFO random number generator by 'steps' steps in one go */
+static unsigned int _pocketmod_skip_rng(unsigned int rng, unsigned int steps)
+{
+    unsigned int mul = 0x0019660d, add = 0x3c6ef35f;
+    for (; steps; steps >>= 1) {
+        if (steps & 1) {
+            rng = mul * rng + add;
+        }
+        add = mul * add + add;
+        mul = mul * mul;
+    }
+    return rng;
+}
+
+/* Mark the patterns with jumps in 'jumps' (if not null), and return */
+/* nonzero if the random LFO waveform is ever used */
+static int _pocketmod_scan_patterns(pocketmod_context *c, unsigned char *jumps)
+{
+    int i, j, uses_rng = 0;
+    for (i = 0; i < c->length; i++) {
+        int pattern = c->order[i];
+        int pos = pattern * 64 * c->num_channels * 4;
+        unsigned char (*data)[4] = (unsigned char(*)[4]) (c->patterns + pos);
+        for (j = 0; j < 64 * c->num_channels; j++) {
+            int effect = ((data[j][2] & 0x0f) << 8) | data[j][3];
+            int line = ((effect >> 4) & 0x0f) * 10 + (effect & 0x0f);
+            if (jumps && ((effect >> 8) == 0xB
+             || ((effect >> 8) == 0xD && line != 0 && line < 64))) {
+                jumps[pattern >> 3] |= 1 << (pattern & 7);
+            } else if (((effect >> 4) == 0xE4 || (effect >> 4) == 0xE7)
+                    && (effect & 3) == 3) {
+                uses_rng = 1;
+            }
+        }
+    }
+    return uses_rng;
+}
+
+/* Check if the first line of a pattern has a Bxx or Dxx. Its first line  */
+/* is played by the cache entry before it, which then doesn't end on the */
+/* following order position. */
+static int _pocketmod_breaks_at_start(pocketmod_context *c, int pattern)
+{
+    int i, pos = pattern * 64 * c->num_channels * 4;
+    unsigned char (*data)[4] = (unsigned char(*)[4]) (c->patterns + pos);
+    for (i = 0; i < c->num_channels; i++) {
+        int command = data[i][2] & 0x0f;
+        if (command == 0xB || command == 0xD) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Called at the start of a pattern: find a cache entry to play back, or */
+/* start recording a new one */
+static void _pocketmod_cache_start(pocketmod_context *c, _pocketmod_cache *m)
+{
+    _pocketmod_cache_entry *entry = (_pocketmod_cache_entry*) (m + 1);
+    int i, pattern = c->order[c->pattern];
+    int following = c->order[_pocketmod_next_order(c, c->pattern)];
+    int jumps = (m->jumps[pattern >> 3] & (1 << (pattern & 7)))
+             || _pocketmod_breaks_at_start(c, following);
+    int order = jumps ? c->pattern : -1;
+    int next = jumps ? 0 : following;
+    unsigned int hash, rng = m->uses_rng ? c->lfo_rng : 0;
+    _pocketmod_state state;
+
+    /* Hash the key and the start state */
+    _pocketmod_capture(c, &state);
+    hash = _pocketmod_hash(&state, sizeof(state));
+    hash = (hash ^ (order & 0xff) ^ (pattern << 8) ^ (next << 16)) * 0x01000193;
+    hash = (hash ^ rng) * 0x01000193;
+
+    /* Look for an entry with the same key and start state */
+    m->at_start = 0;
+    m->position = 0;
+    m->playing = m->recording = 0;
+    for (i = 0; i < m->entries; i++) {
+        if (entry->hash == hash && entry->order == order
+         && entry->pattern == pattern && entry->next == next
+         && entry->lfo_rng == rng
+         && _pocketmod_equal(&entry->start, &state, sizeof(state))) {
+            m->playing = entry;
+            return;
+        }
+        entry = (_pocketmod_cache_entry*)
+                ((char*) entry + POCKETMOD_ENTRY_SIZE(entry->samples));
+    }
+
+    /* Otherwise start recording a new entry, space permitting. Nothing is */
+    /* recorded until all the samples are there. */
+    if (!c->pending && m->used + POCKETMOD_ENTRY_SIZE(0) <= m->size) {
+        m->recording = entry;
+        m->order = c->pattern;
+        m->ticks = c->ticks;
+        entry->hash = hash;
+        entry->order = order;
+        entry->pattern = pattern;
+        entry->next = next;
+        entry->lfo_rng = rng;
+        _pocketmod_copy(&entry->start, &state, sizeof(state));
+    }
+}
+
+/* Add rendered samples to the entry being recorded, and complete the entry */
+/* when the start of the next pattern has been reached */
+static void _pocketmod_cache_record(pocketmod_context *c, _pocketmod_cache *m,
+                                    float (*samples)[2], int num, int done)
+{
+    _pocketmod_cache_entry *entry = m->recording;
+    if (entry && (c->degrade != POCKETMOD_DEGRADE_NONE
+     || m->used + POCKETMOD_ENTRY_SIZE(m->position + num) > m->size)) {
+        entry = m->recording = 0; /* Degraded or out of space, so give up */
+    } else if (entry) {
+        _pocketmod_copy(POCKETMOD_ENTRY_DATA(entry) + m->position, samples,
+                        num * POCKETMOD_SAMPLE_SIZE);
+        m->position += num;
+    }
+    if (done) {
+
+        /* An entry that can be reused anywhere must end on the following */
+        /* order position, since that's where playing it back leads to */
+        if (entry && entry->order < 0
+         && c->pattern != _pocketmod_next_order(c, m->order)) {
+            entry = 0;
+        }
+        if (entry) {
+            entry->samples = m->position;
+            entry->ticks = c->ticks - m->ticks;
+            entry->end = c->pattern;
+            _pocketmod_capture(c, &entry->finish);
+            m->used += POCKETMOD_ENTRY_SIZE(entry->samples);
+            m->entries++;
+        }
+        m->recording = 0;
+        m->at_start = 1;
+    }
+}
+
+/* Play back samples from the cache entry being played */
+static int _pocketmod_cache_play(pocketmod_context *c, _pocketmod_cache *m,
+                                 float (*output)[2], int num)
+{
+    _pocketmod_cache_entry *entry = m->playing;
+    num = _pocketmod_min(num, entry->samples - m->position);
+    _pocketmod_copy(output, POCKETMOD_ENTRY_DATA(entry) + m->position,
+                    num * POCKETMOD_SAMPLE_SIZE);
+    m->position += num;
+
+    /* Jump to the end state when done, as if the stretch had been rendered */
+    if (m->position == entry->samples) {
+        int order = c->pattern;
+        _pocketmod_restore(c, &entry->finish);
+        c->lfo_rng = _pocketmod_skip_rng(c->lfo_rng,
+                                         entry->ticks * c->num_channels);
+        c->ticks += entry->ticks;
+        c->line = 0;
+        c->tick = 0;
+        c->pattern = entry->order >= 0 ? entry->end
+                                       : _pocketmod_next_order(c, order);
+
+        /* The first line of a pattern always marks it as visited, before */
+        /* the loop check at the end */
+        c->visited[order >> 3] |= 1 << (order & 7);
+        _pocketmod_check_loop(c);
+        m->playing = 0;
+        m->at_start = 1;
+    }
+    return num;
+}
+
+/* Half-band interpolation filter (Blackman-windowed sinc). These are the */
+/* taps on either side of the midpoint between two input samples. */
+static const float _pocketmod_halfband[8] = {
+    0.626548176f, -0.183822016f, 0.084936127f, -0.040341610f,
+    0.017578721f, -0.006457999f, 0.001707879f, -0.000149278f
+};
+
+/* Upsample 'num' frames in place by a factor of two. 'history' holds the */
+/* 15 frames of input before these, and is updated for the next call. */
+/* The output lags the input by 8 frames (at the input rate). */
+static void _pocketmod_upsample2(float (*history)[2], float (*buffer)[2],
+                                 int num)
+{
+    float last[15][2], window[16][2];
+    int i, j, n;
+
+    /* Keep the last 15 frames of input for next time */
+    for (i = 0; i < 15; i++) {
+        j = num - 15 + i;
+        last[i][0] = j < 0 ? history[15 + j][0] : buffer[j][0];
+        last[i][1] = j < 0 ? history[15 + j][1] : buffer[j][1];
+    }
+
+    /* Work backwards, so that no input frame is overwritten before use */
+    for (n = num - 1; n >= 0; n--) {
+        const float (*x)[2] = (const float(*)[2]) window;
+        float mid_l = 0.0f, mid_r = 0.0f;
+        if (n >= 15) {
+            x = (const float(*)[2]) buffer + n - 15;
+        } else {
+            for (i = 0; i < 16; i++) {
+                j = n - 15 + i;
+                window[i][0] = j < 0 ? history[15 + j][0] : buffer[j][0];
+                window[i][1] = j < 0 ? history[15 + j][1] : buffer[j][1];
+            }
+        }
+        for (i = 0; i < 8; i++) {
+            mid_l += _pocketmod_halfband[i] * (x[7 - i][0] + x[8 + i][0]);
+            mid_r += _pocketmod_halfband[i] * (x[7 - i][1] + x[8 + i][1]);
+        }
+        buffer[2 * n][0] = x[7][0];
+        buffer[2 * n][1] = x[7][1];
+        buffer[2 * n + 1][0] = mid_l;
+        buffer[2 * n + 1][1] = mid_r;
+    }
+    _pocketmod_copy(history, last, sizeof(last));
+}
+
+/* Adjust the degradation level after a render call that took 'elapsed' */
+/* time. Step up as soon as the budget is overrun, but only step back down */
+/* after a run of calls that needed less than half of it. */
+static void _pocketmod_govern(pocketmod_context *c, unsigned long elapsed)
+{
+    if (elapsed > c->budget) {
+        c->degrade = _pocketmod_min(c->degrade + 1, POCKETMOD_DEGRADE_SHORT);
+        c->calm = 0;
+    } else if (elapsed > c->budget / 2 || !c->degrade) {
+        c->calm = 0;
+    } else if (++c->calm == 16) {
+        c->degrade--;
+        c->calm = 0;
+    }
+}
+
+/* Add 'num' rendered frames to the level meter */
+static void _pocketmod_measure(pocketmod_meter *m, float (*samples)[2],
+                               int num)
+{
+    int i, j;
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < 2; j++) {
+            float x = samples[i][j], a = x < 0.0f ? -x : x;
+            m->peak[j] = a > m->peak[j] ? a : m->peak[j];
+            m->square[j] += x * x;
+        }
+    }
+    m->frames += num;
+}
+
+/* Render and mix a channel like _pocketmod_render_channel(), but go via a */
+/* small buffer so that the channel's own level can be measured. Adding */
+/* each value to zero first doesn't change the result. */
+static void _pocketmod_meter_channel(pocketmod_context *c, int index,
+                                     float *output, int samples)
+{
+    _pocketmod_chan *chan = &c->channels[index];
+    pocketmod_meter *m = c->meter;
+    float buffer[256][2];
+    int i, num;
+    while (samples > 0 && chan->position >= 0.0f) {
+        num = _pocketmod_min(samples, 256);
+        _pocketmod_zero(buffer, num * POCKETMOD_SAMPLE_SIZE);
+        _pocketmod_render_channel(c, chan, *buffer, num);
+        for (i = 0; i < num; i++) {
+            float x = buffer[i][0] + buffer[i][1], a = x < 0.0f ? -x : x;
+            m->voice_peak[index] = a > m->voice_peak[index] ? a
+                                 : m->voice_peak[index];
+            m->voice_square[index] += x * x;
+            *output++ += buffer[i][0];
+            *output++ += buffer[i][1];
+        }
+        samples -= num;
+    }
+}
+
 int pocketmod_render(pocketmod_context *c, void *buffer, int buffer_size)
 {
-    int i, samples_rendered = 0;
+    int i, done = 0, samples_rendered = 0;
     int samples_remaining = buffer_size / POCKETMOD_SAMPLE_SIZE;
+    unsigned long start = 0;
     if (c && buffer) {
         float (*output)[2] = (float(*)[2]) buffer;
-        while (samples_remaining > 0) {
-
-            /* Calculate the number of samples left in this tick */
-            int num = (int) (c->samples_per_tick - c->sample);
-            num = _pocketmod_min(num + !num, samples_remaining);
-
-            /* Render and mix 'num' samples from each channel */
-            _pocketmod_zero(output, num * POCKETMOD_SAMPLE_SIZE);
-            for (i = 0; i < c->num_channels; i++) {
-                _pocketmod_chan *chan = &c->channels[i];
-                if (chan->sample != 0 && chan->position >= 0.0f) {
-                    _pocketmod_render_channel(c, chan, *output, num);
-                }
+        _pocketmod_cache *cache = (_pocketmod_cache*) c->cache;
+        if (c->clock) {
+            start = c->clock(c->clock_data);
+        }
+
+        /* Start the level meter afresh for each call */
+        if (c->meter) {
+            int voices = c->meter->voices;
+            _pocketmod_zero(c->meter, sizeof(pocketmod_meter));
+            c->meter->voices = voices;
+        }
+
+        /* When upsampling, mix at the lower rate into the start of the */
+        /* buffer first. The mix is then upsampled in place. */
+        samples_remaining /= c->upsample;
+
+        /* Play back from the render cache if this part is in it */
+        if (cache && cache->at_start) {
+            _pocketmod_cache_start(c, cache);
+        }
+        if (cache && cache->playing) {
+            samples_rendered = _pocketmod_cache_play(c, cache, output,
+                                                     samples_remaining);
+            if (c->meter) {
+                _pocketmod_measure(c->meter, output, samples_rendered);
             }
-            samples_remaining -= num;
-            samples_rendered += num;
-            output += num;
-
-            /* Advance song position by 'num' samples */
-            if ((c->sample += num) >= c->samples_per_tick) {
-                c->sample -= c->samples_per_tick;
-                _pocketmod_next_tick(c);
-
-                /* Stop if a new pattern was reached */
-                if (c->line == 0 && c->tick == 0) {
-
-                    /* Increment loop counter as needed */
-                    if (c->visited[c->pattern >> 3] & (1 << (c->pattern & 7))) {
-                        _pocketmod_zero(c->visited, sizeof(c->visited));
-                        c->loop_count++;
+        } else {
+            while (samples_remaining > 0) {
+
+                /* Render and mix as far as the voices stay unchanged */
+                /* (in short blocks at the last degradation level) */
+                int num = c->degrade == POCKETMOD_DEGRADE_SHORT
+                        ? _pocketmod_min(samples_remaining, 256)
+                        : samples_remaining;
+                num = _pocketmod_span(c, num);
+                _pocketmod_zero(output, num * POCKETMOD_SAMPLE_SIZE);
+                for (i = 0; i < c->num_channels; i++) {
+                    _pocketmod_chan *chan = &c->channels[i];
+                    if (chan->sample == 0 || chan->position < 0.0f) {
+                        continue;
+                    } else if (c->meter && c->meter->voices) {
+                        _pocketmod_meter_channel(c, i, *output, num);
+                    } else {
+                        _pocketmod_render_channel(c, chan, *output, num);
                     }
+                }
+                if (c->meter) {
+                    _pocketmod_measure(c->meter, output, num);
+                }
+                samples_remaining -= num;
+                samples_rendered += num;
+                output += num;
+
+                /* Stop at the start of a new pattern */
+                if (_pocketmod_advance(c, num)) {
+                    done = 1;
                     break;
                 }
+
+                /* At the last degradation level, hand back what's done so */
+                /* far rather than overrun the budget */
+                if (c->degrade == POCKETMOD_DEGRADE_SHORT
+                 && c->clock(c->clock_data) - start > c->budget) {
+                    break;
+                }
+            }
+
+            /* Keep a copy of what was rendered in the cache */
+            if (cache) {
+                _pocketmod_cache_record(c, cache, (float(*)[2]) buffer,
+                                        samples_rendered, done);
             }
         }
+
+        /* Upsample to the output rate, in one or two stages */
+        for (i = 0; (2 << i) <= c->upsample; i++) {
+            _pocketmod_upsample2(c->history[i], (float(*)[2]) buffer,
+                                 samples_rendered);
+            samples_rendered *= 2;
+        }
+
+        /* Degrade or recover depending on how long this took */
+        if (c->clock) {
+            _pocketmod_govern(c, c->clock(c->clock_data) - start);
+        }
     }
     return samples_rendered * POCKETMOD_SAMPLE_SIZE;
 }
@@ -836,6 +1725,558 @@ int pocketmod_loop_count(pocketmod_context *c)
     return c->loop_count;
 }
 
+/* Check if a context is positioned at the very start of a pattern */
+static int _pocketmod_pattern_start(pocketmod_context *c)
+{
+    return c->line == 0 && c->tick == 0 && c->sample < 1.0f;
+}
+
+int pocketmod_cache(pocketmod_context *c, void *memory, int size)
+{
+    _pocketmod_cache *cache = (_pocketmod_cache*) memory;
+
+    /* A null memory block turns the cache off */
+    if (!c) {
+        return 0;
+    }
+    c->cache = 0;
+    if (!memory) {
+        return 1;
+    }
+
+    /* Make sure there's room for the bookkeeping and at least one entry */
+    if (size < (int) sizeof(_pocketmod_cache) + POCKETMOD_ENTRY_SIZE(1)) {
+        return 0;
+    }
+    _pocketmod_zero(cache, sizeof(_pocketmod_cache));
+    cache->size = size;
+    cache->used = sizeof(_pocketmod_cache);
+    cache->uses_rng = _pocketmod_scan_patterns(c, cache->jumps);
+
+    /* Entries can only be recorded from the start of a pattern */
+    cache->at_start = _pocketmod_pattern_start(c);
+    c->cache = cache;
+    return 1;
+}
+
+/* Render 'samples' samples, discarding the output. Returns nonzero if the */
+/* last sample ended at the start of a new pattern. */
+static int _pocketmod_skip(pocketmod_context *c, int samples)
+{
+    float buffer[256][2];
+    int i, num, done = 0;
+    while (samples > 0) {
+        num = _pocketmod_span(c, _pocketmod_min(samples, 256));
+        _pocketmod_zero(buffer, sizeof(buffer));
+        for (i = 0; i < c->num_channels; i++) {
+            _pocketmod_chan *chan = &c->channels[i];
+            if (chan->sample != 0 && chan->position >= 0.0f) {
+                _pocketmod_render_channel(c, chan, *buffer, num);
+            }
+        }
+        done = _pocketmod_advance(c, num);
+        samples -= num;
+    }
+    return done;
+}
+
+/* While the render cache plays back a pattern, the context stays at the */
+/* start of it. Catch up to the current sample, and stop the playback. */
+static void _pocketmod_cache_catch_up(pocketmod_context *c)
+{
+    _pocketmod_cache *cache = (_pocketmod_cache*) c->cache;
+    if (cache && cache->playing) {
+        cache->playing = 0;
+        _pocketmod_skip(c, cache->position);
+    }
+}
+
+int pocketmod_set_quality(pocketmod_context *c, int quality)
+{
+    _pocketmod_cache *cache;
+    if (quality < POCKETMOD_QUALITY_DEFAULT
+     || quality > POCKETMOD_QUALITY_SINC16) {
+        return 0;
+    }
+
+    /* Build the shared sinc tables on first use */
+    if (quality >= POCKETMOD_QUALITY_SINC8 && !_pocketmod_sinc_ready) {
+        _pocketmod_make_sinc(*_pocketmod_sinc8, 8);
+        _pocketmod_make_sinc(*_pocketmod_sinc16, 16);
+        _pocketmod_sinc_ready = 1;
+    }
+
+    /* With no context, that's all. Otherwise, throw away what the render */
+    /* cache holds if it was rendered at a different quality. */
+    if (!c) {
+        return 1;
+    } else if ((cache = (_pocketmod_cache*) c->cache) && quality != c->quality) {
+        _pocketmod_cache_catch_up(c);
+        cache->used = sizeof(_pocketmod_cache);
+        cache->entries = 0;
+        cache->recording = 0;
+    }
+    c->quality = quality;
+    return 1;
+}
+
+int pocketmod_set_budget(pocketmod_context *c, unsigned long (*clock)(void*),
+                         void *data, unsigned long budget)
+{
+    /* A null clock turns the governor off, and a zero budget is no use */
+    if (!c || (clock && !budget)) {
+        return 0;
+    }
+    c->clock = clock;
+    c->clock_data = data;
+    c->budget = budget;
+    c->degrade = POCKETMOD_DEGRADE_NONE;
+    c->calm = 0;
+    return 1;
+}
+
+int pocketmod_degradation(pocketmod_context *c)
+{
+    return c->degrade;
+}
+
+int pocketmod_set_meter(pocketmod_context *c, pocketmod_meter *meter)
+{
+    if (!c) {
+        return 0;
+    }
+    c->meter = meter;
+    return 1;
+}
+
+/* Render one tick, discarding the output. Returns the number of samples, */
+/* and sets 'done' if the tick ended at the start of a new pattern. */
+static int _pocketmod_skip_tick(pocketmod_context *c, int *done)
+{
+    int total = (int) (c->samples_per_tick - c->sample);
+    total += !total;
+    *done = _pocketmod_skip(c, total);
+    return total;
+}
+
+/* Render up to the start of the next pattern, discarding the output. */
+/* Returns the number of samples. */
+static int _pocketmod_skip_pattern(pocketmod_context *c)
+{
+    int done = 0, total = 0;
+    while (!done) {
+        total += _pocketmod_skip_tick(c, &done);
+    }
+    return total;
+}
+
+/* Check if two contexts will render exactly the same from here on */
+static int _pocketmod_same(pocketmod_context *a, pocketmod_context *b,
+                           int uses_rng)
+{
+    return a->pattern == b->pattern && a->line == b->line
+        && a->tick == b->tick && a->sample == b->sample
+        && a->samples_per_tick == b->samples_per_tick
+        && a->ticks_per_line == b->ticks_per_line
+        && a->pattern_delay == b->pattern_delay
+        && (!uses_rng || a->lfo_rng == b->lfo_rng)
+        && _pocketmod_equal(a->channels, b->channels,
+                            a->num_channels * sizeof(_pocketmod_chan));
+}
+
+int pocketmod_find_loop(const void *data, int size, int rate, int max_frames,
+                        int *intro, int *length)
+{
+    pocketmod_context a, b;
+    int i, uses_rng, frames, start = 0, period = 0, power = 1, steps = 0;
+    int ticks_a = 0, ticks_b = 0, done = 0;
+
+    /* Find the loop length in patterns with Brent's algorithm. The two  */
+    /* contexts are only compared at pattern starts, and 'a' stays put */
+    /* while 'b' runs ahead. */
+    if (!pocketmod_init(&a, data, size, rate)) {
+        return 0;
+    }
+    uses_rng = _pocketmod_scan_patterns(&a, 0);
+    b = a;
+    frames = _pocketmod_skip_pattern(&b);
+    period = frames;
+    steps = 1;
+    while (!_pocketmod_same(&a, &b, uses_rng)) {
+        if (frames > max_frames) {
+            return 0;
+        } else if (steps == power) {
+            a = b;
+            power *= 2;
+            period = steps = 0;
+        }
+        i = _pocketmod_skip_pattern(&b);
+        frames += i;
+        period += i;
+        steps++;
+    }
+
+    /* Find the first pattern start where the loop begins, by running two */
+    /* contexts 'steps' patterns apart until they meet */
+    pocketmod_init(&a, data, size, rate);
+    b = a;
+    for (i = 0; i < steps; i++) {
+        _pocketmod_skip_pattern(&b);
+    }
+    while (!_pocketmod_same(&a, &b, uses_rng)) {
+        pocketmod_context x = a, y = b;
+        i = _pocketmod_skip_pattern(&a);
+        _pocketmod_skip_pattern(&b);
+
+        /* The two may already have met partway through this pattern. If */
+        /* so, they run the same ticks from there to the end of it. */
+        if (_pocketmod_same(&a, &b, uses_rng)) {
+            a = x;
+            b = y;
+            while (!done) {
+                ticks_a++;
+                _pocketmod_skip_tick(&x, &done);
+            }
+            for (done = 0; !done; ticks_b++) {
+                _pocketmod_skip_tick(&y, &done);
+            }
+            for (; ticks_a > ticks_b; ticks_a--) {
+                start += _pocketmod_skip_tick(&a, &done);
+            }
+            for (; ticks_b > ticks_a; ticks_b--) {
+                _pocketmod_skip_tick(&b, &done);
+            }
+            while (!_pocketmod_same(&a, &b, uses_rng)) {
+                start += _pocketmod_skip_tick(&a, &done);
+                _pocketmod_skip_tick(&b, &done);
+            }
+            break;
+        }
+        start += i;
+    }
+    *intro = start;
+    *length = period;
+    return 1;
+}
+
+/* Read a 32-bit little-endian integer */
+static unsigned int _pocketmod_read32(const unsigned char *data)
+{
+    unsigned int value = data[3];
+    value = (value << 8) | data[2];
+    value = (value << 8) | data[1];
+    return (value << 8) | data[0];
+}
+
+int pocketmod_archive_count(const void *archive, int size)
+{
+    const unsigned char *data = (const unsigned char*) archive;
+    unsigned int count;
+
+    /* Check the magic number and version */
+    if (!data || size < POCKETMOD_ARCHIVE_HEADER
+     || data[0] != 'P' || data[1] != 'M' || data[2] != 'A' || data[3] != 'R'
+     || _pocketmod_read32(data + 4) != 1) {
+        return 0;
+    }
+
+    /* Check that the whole index is within bounds */
+    count = _pocketmod_read32(data + 8);
+    if (count > (unsigned) (size - POCKETMOD_ARCHIVE_HEADER)
+              / POCKETMOD_ARCHIVE_ENTRY) {
+        return 0;
+    }
+    return (int) count;
+}
+
+int pocketmod_archive_get(const void *archive, int size, int index,
+                          pocketmod_archive_entry *entry)
+{
+    const unsigned char *data = (const unsigned char*) archive, *e;
+    unsigned int offset, length;
+
+    /* Find the index entry */
+    if (!entry || index < 0 || index >= pocketmod_archive_count(data, size)) {
+        return 0;
+    }
+    e = data + POCKETMOD_ARCHIVE_HEADER + POCKETMOD_ARCHIVE_ENTRY * index;
+
+    /* Check that the name is terminated and the payload is within bounds */
+    offset = _pocketmod_read32(e + POCKETMOD_ARCHIVE_NAME);
+    length = _pocketmod_read32(e + POCKETMOD_ARCHIVE_NAME + 4);
+    if (e[POCKETMOD_ARCHIVE_NAME - 1] != '\0'
+     || offset > (unsigned) size || length > (unsigned) size - offset) {
+        return 0;
+    }
+
+    /* Fill in the entry */
+    entry->name = (const char*) e;
+    entry->data = data + offset;
+    entry->size = (int) length;
+    entry->duration = (int) _pocketmod_read32(e + POCKETMOD_ARCHIVE_NAME + 8);
+    entry->tag[0] = e[POCKETMOD_ARCHIVE_NAME + 12];
+    entry->tag[1] = e[POCKETMOD_ARCHIVE_NAME + 13];
+    entry->tag[2] = e[POCKETMOD_ARCHIVE_NAME + 14];
+    entry->tag[3] = e[POCKETMOD_ARCHIVE_NAME + 15];
+    entry->channels = e[POCKETMOD_ARCHIVE_NAME + 16];
+    return 1;
+}
+
+int pocketmod_archive_init(pocketmod_context *c, const void *archive, int size,
+                           int index, int rate)
+{
+    pocketmod_archive_entry entry;
+    if (!pocketmod_archive_get(archive, size, index, &entry)) {
+        return 0;
+    }
+    return pocketmod_init(c, entry.data, entry.size, rate);
+}
+
+/* Saved state layout: a header, followed by a record for each channel */
+/* and one for each upsampling stage */
+#define POCKETMOD_STATE_VERSION 2
+#define POCKETMOD_STATE_HEADER 68
+#define POCKETMOD_STATE_CHANNEL 35
+#define POCKETMOD_STATE_STAGE 120
+#define POCKETMOD_STATE_SIZE(channels) \
+    (POCKETMOD_STATE_HEADER + (channels) * POCKETMOD_STATE_CHANNEL)
+
+/* Number of upsampling stages a context uses */
+static int _pocketmod_stages(pocketmod_context *c)
+{
+    return c->upsample == 4 ? 2 : c->upsample == 2 ? 1 : 0;
+}
+
+/* Store a little-endian integer of 'bytes' bytes, and move past it */
+static void _pocketmod_put(unsigned char **p, unsigned int value, int bytes)
+{
+    int i;
+    for (i = 0; i < bytes; i++) {
+        *(*p)++ = (value >> (8 * i)) & 0xff;
+    }
+}
+
+/* Load a little-endian integer of 'bytes' bytes, and move past it */
+static unsigned int _pocketmod_get(const unsigned char **p, int bytes)
+{
+    unsigned int value = 0;
+    int i;
+    for (i = 0; i < bytes; i++) {
+        value |= (unsigned int) *(*p)++ << (8 * i);
+    }
+    return value;
+}
+
+/* Convert between a float and its bit pattern */
+static unsigned int _pocketmod_float_bits(float value)
+{
+    union { float f; unsigned int u; } bits;
+    bits.f = value;
+    return bits.u;
+}
+
+static float _pocketmod_bits_float(unsigned int value)
+{
+    union { float f; unsigned int u; } bits;
+    bits.u = value;
+    return bits.f;
+}
+
+int pocketmod_save_state(pocketmod_context *c, void *buffer, int size)
+{
+    unsigned char *start = (unsigned char*) buffer, *p = start;
+    int i, j, stages = _pocketmod_stages(c);
+    int bytes = POCKETMOD_STATE_SIZE(c->num_channels)
+              + stages * POCKETMOD_STATE_STAGE;
+
+    /* With no buffer, just return the size needed */
+    if (!buffer) {
+        return bytes;
+    } else if (size < bytes) {
+        return 0;
+    }
+
+    /* Bring the context up to date if the cache is playing back */
+    _pocketmod_cache_catch_up(c);
+
+    /* Write the header. The song hash covers everything before the */
+    /* pattern data, and ties the state to the song it came from. */
+    _pocketmod_copy(p, "PMST", 4);
+    p += 4;
+    _pocketmod_put(&p, POCKETMOD_STATE_VERSION, 4);
+    _pocketmod_put(&p, _pocketmod_hash(c->source, c->patterns - c->source), 4);
+    p += 4; /* State hash, filled in at the end */
+    _pocketmod_put(&p, c->samples_per_second, 4);
+    _pocketmod_put(&p, c->num_channels, 1);
+    _pocketmod_put(&p, c->pattern, 1);
+    _pocketmod_put(&p, c->line, 1);
+    _pocketmod_put(&p, c->pattern_delay, 1);
+    _pocketmod_put(&p, c->tick, 2);
+    _pocketmod_put(&p, c->ticks_per_line, 2);
+    _pocketmod_put(&p, _pocketmod_float_bits(c->sample), 4);
+    _pocketmod_put(&p, _pocketmod_float_bits(c->samples_per_tick), 4);
+    _pocketmod_put(&p, c->lfo_rng, 4);
+    _pocketmod_put(&p, c->ticks, 4);
+    _pocketmod_put(&p, c->loop_count, 4);
+    _pocketmod_copy(p, c->visited, 16);
+    p += 16;
+    _pocketmod_put(&p, c->upsample, 4);
+
+    /* Write the channels */
+    for (i = 0; i < c->num_channels; i++) {
+        _pocketmod_chan *ch = &c->channels[i];
+        _pocketmod_put(&p, ch->dirty, 1);
+        _pocketmod_put(&p, ch->sample, 1);
+        _pocketmod_put(&p, ch->volume, 1);
+        _pocketmod_put(&p, ch->balance, 1);
+        _pocketmod_put(&p, ch->period, 2);
+        _pocketmod_put(&p, ch->delayed, 2);
+        _pocketmod_put(&p, ch->target, 2);
+        _pocketmod_put(&p, ch->finetune, 1);
+        _pocketmod_put(&p, ch->loop_count, 1);
+        _pocketmod_put(&p, ch->loop_line, 1);
+        _pocketmod_put(&p, ch->lfo_step, 1);
+        _pocketmod_put(&p, ch->lfo_type[0], 1);
+        _pocketmod_put(&p, ch->lfo_type[1], 1);
+        _pocketmod_put(&p, ch->effect, 1);
+        _pocketmod_put(&p, ch->param, 1);
+        _pocketmod_put(&p, ch->param3, 1);
+        _pocketmod_put(&p, ch->param4, 1);
+        _pocketmod_put(&p, ch->param7, 1);
+        _pocketmod_put(&p, ch->param9, 1);
+        _pocketmod_put(&p, ch->paramE1, 1);
+        _pocketmod_put(&p, ch->paramE2, 1);
+        _pocketmod_put(&p, ch->paramEA, 1);
+        _pocketmod_put(&p, ch->paramEB, 1);
+        _pocketmod_put(&p, ch->real_volume, 1);
+        _pocketmod_put(&p, _pocketmod_float_bits(ch->position), 4);
+        _pocketmod_put(&p, _pocketmod_float_bits(ch->increment), 4);
+    }
+
+    /* Write the upsampler history */
+    for (i = 0; i < stages; i++) {
+        for (j = 0; j < 30; j++) {
+            float value = c->history[i][j / 2][j % 2];
+            _pocketmod_put(&p, _pocketmod_float_bits(value), 4);
+        }
+    }
+
+    /* Fill in the hash of everything after it */
+    p = start + 12;
+    _pocketmod_put(&p, _pocketmod_hash(start + 16, bytes - 16), 4);
+    return bytes;
+}
+
+int pocketmod_load_state(pocketmod_context *c, const void *buffer, int size)
+{
+    const unsigned char *start = (const unsigned char*) buffer;
+    const unsigned char *p = start + 20;
+    int i, j, line, tick, ticks_per_line, stages = _pocketmod_stages(c);
+    int bytes = POCKETMOD_STATE_SIZE(c->num_channels)
+              + stages * POCKETMOD_STATE_STAGE;
+    float sample, samples_per_tick;
+
+    /* Make sure the state is intact and belongs to this song and rate */
+    if (!buffer || size < bytes || !_pocketmod_equal(start, "PMST", 4)
+     || _pocketmod_read32(start + 4) != POCKETMOD_STATE_VERSION
+     || _pocketmod_read32(start + 8)
+        != _pocketmod_hash(c->source, c->patterns - c->source)
+     || _pocketmod_read32(start + 12) != _pocketmod_hash(start + 16, bytes - 16)
+     || _pocketmod_read32(start + 16) != (unsigned int) c->samples_per_second
+     || start[20] != c->num_channels || start[21] >= c->length
+     || _pocketmod_read32(start + 64) != (unsigned int) c->upsample) {
+        return 0;
+    }
+
+    /* The hash only catches accidental damage, so also reject anything */
+    /* that could make rendering read out of bounds or never finish a line */
+    line = (signed char) start[22];
+    tick = (short) (start[24] | (start[25] << 8));
+    ticks_per_line = start[26] | (start[27] << 8);
+    sample = _pocketmod_bits_float(_pocketmod_read32(start + 28));
+    samples_per_tick = _pocketmod_bits_float(_pocketmod_read32(start + 32));
+    if (line < -1 || line > 63 || ticks_per_line < 1 || ticks_per_line > 31
+     || tick < 0 || tick >= ticks_per_line || !(sample >= 0.0f)
+     || !(sample < samples_per_tick)
+     || !(samples_per_tick >= 1.0f && samples_per_tick < 1e9f)) {
+        return 0;
+    }
+    for (i = 0; i < c->num_channels; i++) {
+        const unsigned char *ch = start + POCKETMOD_STATE_SIZE(i);
+        float position = _pocketmod_bits_float(_pocketmod_read32(ch + 27));
+        float increment = _pocketmod_bits_float(_pocketmod_read32(ch + 31));
+        line = (signed char) ch[12];
+        if (ch[1] > c->num_samples || ch[1] > POCKETMOD_MAX_SAMPLES
+         || ch[10] > 15 || line < -1 || line > 63
+         || !(position < 262144.0f) || !(increment >= 0.0f)
+         || !(increment < 262144.0f)) {
+            return 0;
+        }
+    }
+
+    /* Read the header */
+    p++; /* Channel count, already checked */
+    c->pattern = (signed char) _pocketmod_get(&p, 1);
+    c->line = (signed char) _pocketmod_get(&p, 1);
+    c->pattern_delay = _pocketmod_get(&p, 1);
+    c->tick = (short) _pocketmod_get(&p, 2);
+    c->ticks_per_line = _pocketmod_get(&p, 2);
+    c->sample = _pocketmod_bits_float(_pocketmod_get(&p, 4));
+    c->samples_per_tick = _pocketmod_bits_float(_pocketmod_get(&p, 4));
+    c->lfo_rng = _pocketmod_get(&p, 4);
+    c->ticks = _pocketmod_get(&p, 4);
+    c->loop_count = _pocketmod_get(&p, 4);
+    _pocketmod_copy(c->visited, p, 16);
+    p += 20; /* Upsampling factor, already checked */
+
+    /* Read the channels */
+    for (i = 0; i < c->num_channels; i++) {
+        _pocketmod_chan *ch = &c->channels[i];
+        ch->dirty = _pocketmod_get(&p, 1);
+        ch->sample = _pocketmod_get(&p, 1);
+        ch->volume = _pocketmod_get(&p, 1);
+        ch->balance = _pocketmod_get(&p, 1);
+        ch->period = _pocketmod_get(&p, 2);
+        ch->delayed = _pocketmod_get(&p, 2);
+        ch->target = _pocketmod_get(&p, 2);
+        ch->finetune = _pocketmod_get(&p, 1);
+        ch->loop_count = _pocketmod_get(&p, 1);
+        ch->loop_line = _pocketmod_get(&p, 1);
+        ch->lfo_step = _pocketmod_get(&p, 1);
+        ch->lfo_type[0] = _pocketmod_get(&p, 1);
+        ch->lfo_type[1] = _pocketmod_get(&p, 1);
+        ch->effect = _pocketmod_get(&p, 1);
+        ch->param = _pocketmod_get(&p, 1);
+        ch->param3 = _pocketmod_get(&p, 1);
+        ch->param4 = _pocketmod_get(&p, 1);
+        ch->param7 = _pocketmod_get(&p, 1);
+        ch->param9 = _pocketmod_get(&p, 1);
+        ch->paramE1 = _pocketmod_get(&p, 1);
+        ch->paramE2 = _pocketmod_get(&p, 1);
+        ch->paramEA = _pocketmod_get(&p, 1);
+        ch->paramEB = _pocketmod_get(&p, 1);
+        ch->real_volume = _pocketmod_get(&p, 1);
+        ch->position = _pocketmod_bits_float(_pocketmod_get(&p, 4));
+        ch->increment = _pocketmod_bits_float(_pocketmod_get(&p, 4));
+    }
+
+    /* Read the upsampler history */
+    for (i = 0; i < stages; i++) {
+        for (j = 0; j < 30; j++) {
+            unsigned int value = _pocketmod_get(&p, 4);
+            c->history[i][j / 2][j % 2] = _pocketmod_bits_float(value);
+        }
+    }
+
+    /* Anything the render cache was in the middle of no longer applies */
+    if (c->cache) {
+        _pocketmod_cache *cache = (_pocketmod_cache*) c->cache;
+        cache->recording = cache->playing = 0;
+        cache->at_start = _pocketmod_pattern_start(c);
+    }
+    return 1;
+}
+
 #endif /* #ifdef POCKETMOD_IMPLEMENTATION */
 
 #ifdef __cplusplus
@@ -0,0 +1,347 @@
+/* See end of file for license */
+
+#ifndef POCKETMOD_HPP_INCLUDED
+#define POCKETMOD_HPP_INCLUDED
+
+#include "pocketmod.h"
+
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace pocketmod {
+
+/* Sample interpolation modes */
+enum class interpolation { nearest, linear };
+
+#ifdef POCKETMOD_NO_INTERPOLATION
+static const interpolation default_interpolation = interpolation::nearest;
+#else
+static const interpolation default_interpolation = interpolation::linear;
+#endif
+
+/* Output channel layouts. Stereo output is interleaved left/right frames. */
+struct stereo
+{
+    static const int channels = 2;
+    static void store(float *out, const float *level, float s)
+    {
+        out[0] += level[0] * s;
+        out[1] += level[1] * s;
+    }
+};
+
+struct mono
+{
+    static const int channels = 1;
+    static void store(float *out, const float *level, float s)
+    {
+        out[0] += level[2] * s;
+    }
+};
+
+namespace detail {
+
+/* Convert a mixed sample to the output sample type */
+template <typename Sample> inline Sample convert(float value);
+
+template <> inline float convert<float>(float value)
+{
+    return value;
+}
+
+template <> inline short convert<short>(float value)
+{
+    value = value < -1.0f ? -1.0f : value;
+    value = value > +1.0f ? +1.0f : value;
+    return (short) (value * 0x7fff);
+}
+
+/* Resample and mix one voice. This follows _pocketmod_render_channel() in */
+/* pocketmod.h step for step, so the two produce the same output. */
+template <bool Looped, interpolation Interpolation, typename Layout>
+inline void mix_voice(_pocketmod_chan *chan, const signed char *data,
+                      int sample_end, int loop_length, const float *level,
+                      float *out, int samples_to_write)
+{
+    const int wrap = Looped ? loop_length : 1; /* Hold the last data point */
+    float position = chan->position;
+    const float increment = chan->increment;
+    while (samples_to_write > 0) {
+
+        /* Calculate how many samples we can write in one go */
+        float estimate = (sample_end - position) / increment;
+        int num = estimate < samples_to_write ? (int) estimate + 1
+                                              : samples_to_write;
+
+        /* Resample and write up to 'num' samples */
+        int i;
+        for (i = 0; i < num && position < sample_end; i++) {
+            int x0 = (int) position;
+            float s;
+            if (Interpolation == interpolation::nearest) {
+                s = data[x0];
+            } else {
+                int x1 = x0 + 1 - wrap * (x0 + 1 >= sample_end);
+                float t = position - x0;
+                s = (1.0f - t) * data[x0] + t * data[x1];
+            }
+            position += increment;
+            Layout::store(out, level, s);
+            out += Layout::channels;
+        }
+        samples_to_write -= i;
+
+        /* Rewind the sample when reaching the loop point, or cut it if the */
+        /* end is reached */
+        if (position >= sample_end) {
+            if (!Looped) {
+                position = -1.0f;
+                break;
+            }
+            position -= loop_length;
+        }
+    }
+    chan->position = position;
+}
+
+/* Move a voice along without reading its data, like the skip path in */
+/* _pocketmod_render_channel(). Used for samples that haven't loaded yet. */
+template <bool Looped>
+inline void move_voice(_pocketmod_chan *chan, int sample_end, int loop_length,
+                       int samples_to_write)
+{
+    float position = chan->position;
+    const float increment = chan->increment;
+    while (samples_to_write > 0) {
+        float estimate = (sample_end - position) / increment;
+        int num = estimate < samples_to_write ? (int) estimate + 1
+                                              : samples_to_write;
+        int i;
+        for (i = 0; i < num && position < sample_end; i++) {
+            position += increment;
+        }
+        samples_to_write -= i;
+        if (position >= sample_end) {
+            if (!Looped) {
+                position = -1.0f;
+                break;
+            }
+            position -= loop_length;
+        }
+    }
+    chan->position = position;
+}
+
+} /* namespace detail */
+
+/* A MOD file copied into memory that lives as long as the object */
+class song
+{
+public:
+    song(const void *data, int size)
+        : data_((const unsigned char*) data, (const unsigned char*) data + size)
+    {
+        validate();
+    }
+
+    explicit song(std::vector<unsigned char> data) : data_(std::move(data))
+    {
+        validate();
+    }
+
+    const unsigned char *data() const { return data_.data(); }
+    int size() const { return (int) data_.size(); }
+    const pocketmod_info &info() const { return info_; }
+
+private:
+    void validate()
+    {
+        if (!pocketmod_probe(data(), size(), &info_)) {
+            throw std::invalid_argument("pocketmod: not a valid MOD file");
+        }
+    }
+
+    std::vector<unsigned char> data_;
+    pocketmod_info info_;
+};
+
+/* A renderer whose mixer is specialized at compile time.                   */
+/*                                                                          */
+/* Channels:      The song's channel count, or 0 to accept any count. With  */
+/*                a fixed count the per-channel loop can be unrolled.       */
+/* Interpolation: interpolation::nearest or interpolation::linear.          */
+/* Sample:        Output sample type, float or short (16-bit, clipped).     */
+/* Layout:        pocketmod::stereo (interleaved) or pocketmod::mono.       */
+/*                                                                          */
+/* Sequencing is done by the same code as pocketmod_render(), and the data  */
+/* passed to the constructor must stay valid while the player is in use.   */
+template <int Channels = 0,
+          interpolation Interpolation = default_interpolation,
+          typename Sample = float,
+          typename Layout = stereo>
+class player
+{
+    static_assert(Channels >= 0 && Channels <= POCKETMOD_MAX_CHANNELS,
+                  "pocketmod: channel count out of range");
+    static_assert(std::is_same<Sample, float>::value
+               || std::is_same<Sample, short>::value,
+                  "pocketmod: output samples must be float or short");
+
+public:
+    typedef Sample sample_type;
+    typedef Layout layout_type;
+
+    player(const void *data, int size, int rate)
+    {
+        init(data, size, rate);
+    }
+
+    player(const song &s, int rate)
+    {
+        init(s.data(), s.size(), rate);
+    }
+
+    /* The player reads the song's data as it plays, so it can't be given */
+    /* a temporary song that would be gone by then */
+    player(song &&s, int rate) = delete;
+
+    /* Render up to 'frames' frames (each Layout::channels samples long) to */
+    /* 'output', and return the number of frames written. Like            */
+    /* pocketmod_render(), this stops early at the start of a pattern.    */
+    int render(Sample *output, int frames)
+    {
+        /* Float stereo output is mixed in place; anything else goes via a */
+        /* small buffer and is converted afterwards */
+        const bool in_place = std::is_same<Sample, float>::value
+                           && std::is_same<Layout, stereo>::value;
+        const int block = 256;
+        float buffer[block * Layout::channels];
+        int rendered = 0;
+        while (rendered < frames) {
+            Sample *out = output + rendered * Layout::channels;
+            float *mix = in_place ? (float*) (void*) out : buffer;
+            int i, num = _pocketmod_span(&context_, frames - rendered);
+            num = in_place || num < block ? num : block;
+
+            /* Render and mix the span */
+            for (i = 0; i < num * Layout::channels; i++) {
+                mix[i] = 0.0f;
+            }
+            mix_channels(mix, num);
+            if (!in_place) {
+                for (i = 0; i < num * Layout::channels; i++) {
+                    out[i] = detail::convert<Sample>(mix[i]);
+                }
+            }
+            rendered += num;
+
+            /* Stop at the start of a new pattern */
+            if (_pocketmod_advance(&context_, num)) {
+                break;
+            }
+        }
+        return rendered;
+    }
+
+    int loop_count() { return pocketmod_loop_count(&context_); }
+    pocketmod_context &context() { return context_; }
+
+private:
+    void init(const void *data, int size, int rate)
+    {
+        if (!pocketmod_init(&context_, data, size, rate)) {
+            throw std::invalid_argument("pocketmod: not a valid MOD file");
+        } else if (Channels != 0 && context_.num_channels != Channels) {
+            throw std::invalid_argument("pocketmod: wrong channel count");
+        }
+    }
+
+    /* Mix every active voice into 'mix'. With a fixed channel count, the */
+    /* loop has a constant trip count and the compiler can unroll it. */
+    void mix_channels(float *mix, int num)
+    {
+        const int count = Channels ? Channels : context_.num_channels;
+        for (int i = 0; i < count; i++) {
+            _pocketmod_chan *chan = &context_.channels[i];
+            if (chan->sample == 0 || chan->position < 0.0f
+             || chan->increment <= 0.0f) {
+                continue;
+            }
+
+            /* Gather loop data, exactly like _pocketmod_render_channel() */
+            const _pocketmod_sample *sample = &context_.samples[chan->sample - 1];
+            const unsigned char *data = context_.source + 12 + 30 * chan->sample;
+            const int loop_start = ((data[4] << 8) | data[5]) << 1;
+            const int loop_length = ((data[6] << 8) | data[7]) << 1;
+            const int loop_end = loop_length > 2 ? loop_start + loop_length
+                                                 : 0xffffff;
+            const bool looped = loop_end <= (int) sample->length;
+            const int sample_end = looped ? loop_end : (int) sample->length;
+
+            /* A sample that hasn't loaded yet plays silently, but keeps */
+            /* its place */
+            if ((context_.pending >> (chan->sample - 1)) & 1) {
+                if (looped) {
+                    detail::move_voice<true>(chan, sample_end, loop_length,
+                                             num);
+                } else {
+                    detail::move_voice<false>(chan, sample_end, loop_length,
+                                              num);
+                }
+                continue;
+            }
+
+            /* Calculate left/right/mono levels */
+            const float volume = chan->real_volume / (float) (128 * 64 * 4);
+            const float level[3] = {
+                volume * (1.0f - chan->balance / 255.0f),
+                volume * (0.0f + chan->balance / 255.0f),
+                volume
+            };
+
+            if (looped) {
+                detail::mix_voice<true, Interpolation, Layout>(chan,
+                    sample->data, sample_end, loop_length, level, mix, num);
+            } else {
+                detail::mix_voice<false, Interpolation, Layout>(chan,
+                    sample->data, sample_end, loop_length, level, mix, num);
+            }
+        }
+    }
+
+    pocketmod_context context_;
+};
+
+/* The common case: a 4-channel ProTracker song rendered to float stereo */
+typedef player<4> mk_player;
+
+} /* namespace pocketmod */
+
+#endif /* #ifndef POCKETMOD_HPP_INCLUDED */
+
+/*******************************************************************************
+
+MIT License
+
+Copyright (c) 2018 rombankzero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*******************************************************************************/
@@ -0,0 +1,141 @@
+/* Regression checks for the render cache: a song must sound the same with */
+/* and without it. Exits with a nonzero status if any check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POCKETMOD_IMPLEMENTATION
+#include "pocketmod.h"
+
+#define SAMPLE_RATE 22050
+#define NUM_PATTERNS 4
+#define SAMPLE_WORDS 32
+
+/* Size of a 4-channel MOD file with NUM_PATTERNS patterns and one sample */
+#define MOD_SIZE (1084 + NUM_PATTERNS * 1024 + SAMPLE_WORDS * 2)
+
+/* Store a note in a pattern cell */
+static void put_note(unsigned char *mod, int pattern, int line, int channel,
+                     int sample, int period, int effect)
+{
+    unsigned char *cell = mod + 1084 + pattern * 1024 + line * 16 + channel * 4;
+    cell[0] = (sample & 0xf0) | ((period >> 8) & 0x0f);
+    cell[1] = period & 0xff;
+    cell[2] = ((sample & 0x0f) << 4) | ((effect >> 8) & 0x0f);
+    cell[3] = effect & 0xff;
+}
+
+/* Build a song with the given order list. Each pattern plays a different */
+/* note on every 16th line, so misplaced patterns change the output. */
+static void make_song(unsigned char *mod, const unsigned char *order,
+                      int length)
+{
+    unsigned char *sample = mod + 1084 + NUM_PATTERNS * 1024;
+    int i, j;
+    memset(mod, 0, MOD_SIZE);
+    mod[42] = SAMPLE_WORDS >> 8;            /* Sample 1 length in words */
+    mod[43] = SAMPLE_WORDS & 0xff;
+    mod[45] = 64;                           /* Volume                   */
+    mod[49] = SAMPLE_WORDS;                 /* Loop the whole sample    */
+    mod[950] = length;
+    memcpy(mod + 952, order, length);
+    memcpy(mod + 1080, "M.K.", 4);
+    for (i = 0; i < NUM_PATTERNS; i++) {
+        for (j = 0; j < 64; j += 16) {
+            put_note(mod, i, j, 0, 1, 214 + 107 * i + j, 0);
+        }
+    }
+    for (i = 0; i < SAMPLE_WORDS * 2; i++) {
+        sample[i] = i < SAMPLE_WORDS ? 0x40 : 0xc0;
+    }
+}
+
+/* Render a song until it loops, optionally with a render cache, and */
+/* return a hash of the output (and its length in frames) */
+static unsigned long render_song(unsigned char *mod, int cached,
+                                 unsigned long *frames)
+{
+    static char cache[1 << 22];
+    pocketmod_context context;
+    float buffer[1024][2];
+    unsigned long hash = 2166136261ul;
+    if (!pocketmod_init(&context, mod, MOD_SIZE, SAMPLE_RATE)
+     || (cached && !pocketmod_cache(&context, cache, sizeof(cache)))) {
+        return 0;
+    }
+    *frames = 0;
+    while (pocketmod_loop_count(&context) == 0) {
+        int i, bytes = pocketmod_render(&context, buffer, sizeof(buffer));
+        for (i = 0; i < bytes; i++) {
+            hash = ((hash ^ ((unsigned char*) buffer)[i]) * 16777619ul)
+                 & 0xfffffffful;
+        }
+        *frames += bytes / sizeof(float[2]);
+    }
+    return hash;
+}
+
+/* Check that a song renders the same with and without the cache */
+static int check_song(const char *name, unsigned char *mod)
+{
+    unsigned long frames, cached_frames;
+    unsigned long hash = render_song(mod, 0, &frames);
+    unsigned long cached_hash = render_song(mod, 1, &cached_frames);
+    if (!hash || hash != cached_hash || frames != cached_frames) {
+        printf("FAIL: %s (%lu frames, %lu with the cache)\n", name, frames,
+               cached_frames);
+        return 0;
+    }
+    printf("ok: %s\n", name);
+    return 1;
+}
+
+/* Check that the cache records a song that was loaded progressively, once */
+/* the last of it has been appended */
+static int check_appended(const char *name, unsigned char *mod)
+{
+    static char cache[1 << 22];
+    pocketmod_context context;
+    float buffer[1024][2];
+    const int head = MOD_SIZE - SAMPLE_WORDS * 2;
+    if (!pocketmod_init_partial(&context, mod, head, SAMPLE_RATE)
+     || pocketmod_append(&context, MOD_SIZE - head) != 0
+     || !pocketmod_cache(&context, cache, sizeof(cache))) {
+        printf("FAIL: %s (can't load the song)\n", name);
+        return 0;
+    }
+    while (pocketmod_loop_count(&context) == 0) {
+        pocketmod_render(&context, buffer, sizeof(buffer));
+    }
+    if (((_pocketmod_cache*) context.cache)->entries == 0) {
+        printf("FAIL: %s (nothing was cached)\n", name);
+        return 0;
+    }
+    printf("ok: %s\n", name);
+    return 1;
+}
+
+int main(void)
+{
+    static unsigned char mod[MOD_SIZE];
+    static const unsigned char order[] = { 0, 1, 2, 0, 1, 3 };
+    int ok = 1;
+
+    /* A pattern break on the first line of a pattern is played by the */
+    /* cache entry of the pattern before it */
+    make_song(mod, order, sizeof(order));
+    put_note(mod, 1, 0, 1, 0, 0, 0xD00);
+    ok &= check_song("D00 on the first line of the next pattern", mod);
+
+    /* The same with a jump to another order position */
+    make_song(mod, order, sizeof(order));
+    put_note(mod, 1, 0, 1, 0, 0, 0xB05);
+    ok &= check_song("B05 on the first line of the next pattern", mod);
+
+    /* A song whose samples arrived after it started playing */
+    make_song(mod, order, sizeof(order));
+    ok &= check_appended("cache after the last append", mod);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/* Regression checks for saved states: a state with out-of-range fields must */
+/* be rejected, even when its hash has been fixed up to match. Exits with a */
+/* nonzero status if any check fails. */
+
+#include <stdio.h>
+#include <string.h>
+
+#define POCKETMOD_IMPLEMENTATION
+#include "pocketmod.h"
+
+#define SAMPLE_RATE 22050
+#define SAMPLE_WORDS 32
+
+/* Size of a 4-channel MOD file with one pattern and one sample */
+#define MOD_SIZE (1084 + 1024 + SAMPLE_WORDS * 2)
+
+/* Offsets of fields in a saved state, and in its first channel */
+#define STATE_LINE 22
+#define STATE_TICKS_PER_LINE 26
+#define STATE_SAMPLE 28
+#define STATE_SAMPLES_PER_TICK 32
+#define CHANNEL (POCKETMOD_STATE_SIZE(0))
+#define CHANNEL_SAMPLE (CHANNEL + 1)
+#define CHANNEL_FINETUNE (CHANNEL + 10)
+#define CHANNEL_LOOP_LINE (CHANNEL + 12)
+#define CHANNEL_POSITION (CHANNEL + 27)
+#define CHANNEL_INCREMENT (CHANNEL + 31)
+
+/* Build a song that plays a looped sample on every 4th line */
+static void make_song(unsigned char *mod)
+{
+    unsigned char *sample = mod + 1084 + 1024;
+    int i;
+    memset(mod, 0, MOD_SIZE);
+    mod[42] = SAMPLE_WORDS >> 8;            /* Sample 1 length in words */
+    mod[43] = SAMPLE_WORDS & 0xff;
+    mod[45] = 64;                           /* Volume                   */
+    mod[49] = SAMPLE_WORDS;                 /* Loop the whole sample    */
+    mod[950] = 1;                           /* Song length              */
+    memcpy(mod + 1080, "M.K.", 4);
+    for (i = 0; i < 64; i += 4) {
+        unsigned char *cell = mod + 1084 + i * 16;
+        cell[0] = 428 >> 8;
+        cell[1] = 428 & 0xff;
+        cell[2] = 0x10;
+    }
+    for (i = 0; i < SAMPLE_WORDS * 2; i++) {
+        sample[i] = i < SAMPLE_WORDS ? 0x40 : 0xc0;
+    }
+}
+
+/* Store a little-endian value in a state */
+static void put(unsigned char *state, int offset, unsigned int value,
+                int bytes)
+{
+    unsigned char *p = state + offset;
+    _pocketmod_put(&p, value, bytes);
+}
+
+/* Recompute a state's hash, as someone forging a state would */
+static void rehash(unsigned char *state, int size)
+{
+    put(state, 12, _pocketmod_hash(state + 16, size - 16), 4);
+}
+
+/* Check that a state with one field changed is rejected, and that the */
+/* context it was offered to still renders */
+static int check_forged(const char *name, pocketmod_context *c,
+                        const unsigned char *state, int size, int offset,
+                        unsigned int value, int bytes)
+{
+    unsigned char forged[1024];
+    float buffer[1024][2];
+    memcpy(forged, state, size);
+    put(forged, offset, value, bytes);
+    rehash(forged, size);
+    if (pocketmod_load_state(c, forged, size)) {
+        printf("FAIL: %s (the state was accepted)\n", name);
+        return 0;
+    }
+    pocketmod_render(c, buffer, sizeof(buffer));
+    printf("ok: %s\n", name);
+    return 1;
+}
+
+int main(void)
+{
+    static unsigned char mod[MOD_SIZE];
+    unsigned char state[1024];
+    float buffer[1000][2];
+    pocketmod_context c;
+    int size, ok = 1;
+
+    /* Save a state from the middle of a line */
+    make_song(mod);
+    if (!pocketmod_init(&c, mod, MOD_SIZE, SAMPLE_RATE)
+     || !pocketmod_render(&c, buffer, sizeof(buffer))
+     || !(size = pocketmod_save_state(&c, state, sizeof(state)))
+     || !pocketmod_load_state(&c, state, size)) {
+        printf("FAIL: can't save and load a state\n");
+        return 1;
+    }
+
+    /* Song position */
+    ok &= check_forged("line past the end of the pattern", &c, state, size,
+                       STATE_LINE, 64, 1);
+    ok &= check_forged("zero ticks per line", &c, state, size,
+                       STATE_TICKS_PER_LINE, 0, 2);
+    ok &= check_forged("sample position past the end of the tick", &c, state,
+                       size, STATE_SAMPLE, _pocketmod_float_bits(1e7f), 4);
+    ok &= check_forged("negative sample position", &c, state, size,
+                       STATE_SAMPLE, _pocketmod_float_bits(-1.0f), 4);
+    ok &= check_forged("tick shorter than one sample", &c, state, size,
+                       STATE_SAMPLES_PER_TICK, _pocketmod_float_bits(0.5f), 4);
+
+    /* Channels */
+    ok &= check_forged("sample number past the sample count", &c, state, size,
+                       CHANNEL_SAMPLE, POCKETMOD_MAX_SAMPLES + 1, 1);
+    ok &= check_forged("finetune out of range", &c, state, size,
+                       CHANNEL_FINETUNE, 16, 1);
+    ok &= check_forged("loop line past the end of the pattern", &c, state,
+                       size, CHANNEL_LOOP_LINE, 64, 1);
+    ok &= check_forged("position past the end of any sample", &c, state, size,
+                       CHANNEL_POSITION, _pocketmod_float_bits(1e7f), 4);
+    ok &= check_forged("negative increment", &c, state, size,
+                       CHANNEL_INCREMENT, _pocketmod_float_bits(-1.0f), 4);
+
+    /* The untouched state must still load */
+    rehash(state, size);
+    if (!pocketmod_load_state(&c, state, size)) {
+        printf("FAIL: the original state was rejected\n");
+        ok = 0;
+    }
+    return ok ? 0 : 1;
+}